@@ -0,0 +1,253 @@
+// Latencies of the firmware on the simulated servo bus and serial link, for several bus baud
+// rates and numbers of axes. Commands arrive at random moments of the main loop, so the spread
+// shows how long a command may wait for the loop, reported as p50 and p99 over the samples.
+// Time is the simulated one: bytes on the wire, return delays and timeouts, CPU time is not.
+
+#include "../gservo.h"
+
+#include <DynamixelSim.h>
+#include <EEPROM.h>
+#include <Stream.h>
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace gservo {
+template <>
+Set<1> defSettings<1>()
+{
+    return baseSettings<1>();
+}
+
+template <>
+Set<2> defSettings<2>()
+{
+    return baseSettings<2>();
+}
+
+template <>
+Set<4> defSettings<4>()
+{
+    return baseSettings<4>();
+}
+
+template <>
+Set<6> defSettings<6>()
+{
+    return baseSettings<6>();
+}
+} // namespace gservo
+
+namespace {
+using namespace gservo;
+
+// As in the sketch.
+constexpr unsigned long serialBaud = 9600;
+constexpr int samples = 200;
+// CPU time of one pass of the main loop, which the simulation does not count.
+constexpr unsigned long passUs = 50;
+// Replies which do not come are counted with this latency.
+constexpr unsigned long giveUpUs = 5000000;
+
+struct Stats {
+    unsigned long p50;
+    unsigned long p99;
+};
+
+Stats stats(std::vector<unsigned long> v)
+{
+    std::sort(v.begin(), v.end());
+    return {v[v.size() / 2], v[v.size() * 99 / 100]};
+}
+
+// Firmware of the sketch with N servos at the given baud rate, driven by its main loop.
+template <int N>
+class Rig {
+public:
+    explicit Rig(unsigned long baud)
+        : bus_{N}, term_{serialBaud}, motors_{&bus_}, out_{&term_}, cb_{&out_, &motors_},
+          parser_{&cb_}
+    {
+        const auto b = static_cast<uint8_t>(2000000ul / baud - 1);
+        for (int i = 1; i <= N; ++i) {
+            bus_.servo(static_cast<uint8_t>(i))->write(DYN_ADDRESS_BAUDRATE, 1, &b);
+        }
+        bus_.begin(baud);
+        bus_.onWrite([this](uint8_t, uint8_t addr, uint8_t len) {
+            if (!goalUs_ && addr <= DYN_ADDRESS_GOAL_POSITION
+                && addr + len > DYN_ADDRESS_GOAL_POSITION) {
+                goalUs_ = micros();
+            }
+        });
+    }
+
+    // From power on to the first pass of the main loop.
+    unsigned long boot()
+    {
+        const auto t = micros();
+        cb_.begin();
+        return micros() - t;
+    }
+
+    // Line arrival to the first goal position on the wire.
+    unsigned long move(unsigned long delay, float pos)
+    {
+        send(delay, moveLine(pos));
+        goalUs_ = 0;
+        while (!goalUs_) {
+            pass();
+        }
+        const auto us = goalUs_ - arrival_;
+        settle();
+        return us;
+    }
+
+    // Status request arrival to the last byte of the report on the serial line.
+    unsigned long status(unsigned long delay)
+    {
+        send(delay, "?\n");
+        std::string got;
+        size_t end;
+        while ((end = got.find(">\n")) == std::string::npos) {
+            if (micros() > arrival_ + giveUpUs) {
+                settle();
+                return giveUpUs;
+            }
+            pass();
+            got += term_.take();
+        }
+        // Bytes after the report, e.g. the ack, went out in the same pass.
+        const auto after = got.size() - end - 2;
+        const auto us = term_.sentUs() - after * 10000000ul / serialBaud - arrival_;
+        settle();
+        return us;
+    }
+
+    // Stop request arrival during a move to all servos at rest.
+    unsigned long stop(unsigned long delay, float pos)
+    {
+        send(0, moveLine(pos));
+        goalUs_ = 0;
+        while (!goalUs_ || !line_.empty()) {
+            pass();
+        }
+        send(delay, "!\n");
+        while (!line_.empty() || moving()) {
+            pass();
+        }
+        const auto us = micros() - arrival_;
+        settle();
+        return us;
+    }
+
+private:
+    static std::string moveLine(float pos)
+    {
+        std::string s = "g0";
+        char buf[16];
+        for (int i = 0; i < N; ++i) {
+            snprintf(buf, sizeof(buf), " %c%.0f", coordNames[i], pos);
+            s += buf;
+        }
+        return s + "\n";
+    }
+
+    void send(unsigned long delay, const std::string& line)
+    {
+        line_ = line;
+        arrival_ = micros() + delay;
+    }
+
+    // Main loop of the sketch: a line is taken once it arrived and, while moving or producing
+    // output, only when it is a status request, a stop or a tracking sample.
+    void pass()
+    {
+        if (!line_.empty() && micros() >= arrival_ && cb_.accepts(line_[0])) {
+            parser_.parse(line_.c_str(), static_cast<int>(line_.size()));
+            line_.clear();
+        }
+        cb_.loop();
+        out_.drain();
+        host::Clock::advance(passUs);
+    }
+
+    bool moving()
+    {
+        for (int i = 1; i <= N; ++i) {
+            auto s = bus_.servo(static_cast<uint8_t>(i));
+            s->advance(micros());
+            if (s->reg(host::SimServo::regMoving)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Until servos rest and output is on the wire.
+    void settle()
+    {
+        while (moving() || motors_.isMoving() || !out_.empty() || term_.sentUs() > micros()) {
+            pass();
+        }
+        term_.take();
+    }
+
+    host::SimBus bus_;
+    host::Terminal term_;
+    Motors<N> motors_;
+    OutQueue out_;
+    CallbacksImpl<N> cb_;
+    Parser<N> parser_;
+    std::string line_;
+    unsigned long arrival_{};
+    unsigned long goalUs_{};
+};
+
+template <int N>
+void bench(unsigned long baud, std::mt19937& rnd)
+{
+    host::eraseEeprom();
+    Rig<N> rig{baud};
+    const auto boot = rig.boot();
+    std::uniform_int_distribution<unsigned long> phase{0, 20000};
+    std::uniform_int_distribution<unsigned long> during{0, 200000};
+    std::vector<unsigned long> move;
+    std::vector<unsigned long> status;
+    std::vector<unsigned long> stop;
+    for (int i = 0; i < samples; ++i) {
+        move.push_back(rig.move(phase(rnd), i % 2 ? 0.f : 10.f));
+        status.push_back(rig.status(phase(rnd)));
+        stop.push_back(rig.stop(during(rnd), i % 2 ? 0.f : 90.f));
+    }
+    const auto m = stats(move);
+    const auto st = stats(status);
+    const auto sp = stats(stop);
+    printf("%4d %8lu %8lu %9lu %9lu %9lu %9lu %9lu %9lu\n", N, baud, boot, m.p50, m.p99, st.p50,
+           st.p99, sp.p50, sp.p99);
+}
+
+template <int N>
+void benchBauds(std::mt19937& rnd)
+{
+    for (auto baud : {9600ul, 57600ul, 1000000ul}) {
+        bench<N>(baud, rnd);
+    }
+}
+} // namespace
+
+int main()
+{
+    std::mt19937 rnd{1};
+    printf("Latency, us, serial link at %lu baud, %d samples\n", serialBaud, samples);
+    printf("%4s %8s %8s %9s %9s %9s %9s %9s %9s\n", "axes", "baud", "boot", "move p50", "p99",
+           "? p50", "p99", "! p50", "p99");
+    benchBauds<1>(rnd);
+    benchBauds<2>(rnd);
+    benchBauds<4>(rnd);
+    benchBauds<6>(rnd);
+    return 0;
+}
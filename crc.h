@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace gservo {
+
+// CRC-16 with polynomial 0x8005, zero initial value and no reflection, as used by
+// Dynamixel Protocol 2.0. Computed bitwise to keep the lookup table out of flash.
+inline uint16_t crc16(uint16_t crc, const uint8_t* data, size_t len)
+{
+    while (len--) {
+        crc ^= static_cast<uint16_t>(*data++) << 8;
+        for (int i = 0; i < 8; ++i) {
+            const bool msb = crc & 0x8000;
+            crc = static_cast<uint16_t>(crc << 1);
+            if (msb) {
+                crc ^= 0x8005;
+            }
+        }
+    }
+    return crc;
+}
+
+} // namespace gservo
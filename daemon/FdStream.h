@@ -0,0 +1,150 @@
+#pragma once
+
+// Command link of the Linux daemon, a pty or a Unix socket, as the Stream the firmware talks to.
+
+#include <Stream.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace gservod {
+
+// Non-blocking fd with buffers on both sides: receive() takes what arrived, send() passes on
+// what was written as far as the fd accepts it. Room for writes is the free space of the output
+// buffer, so a client which does not read makes the firmware drop bulk output, as a slow link does.
+// The input buffer holds a few lines: once it is full the fd is not read, so a client which sends
+// faster than its lines are run waits on its socket. A line longer than the sketch takes is cut
+// as the sketch cuts it, so a full buffer always has a whole line to give.
+class FdStream final : public Stream {
+public:
+    using Print::write;
+
+    // The line buffer of the sketch, the rest of a longer line is dropped.
+    static constexpr size_t lineMax = 128;
+
+    explicit FdStream(int fd = -1, size_t outMax = 4096, size_t inMax = 4 * lineMax)
+        : fd_(fd), outMax_(outMax), inMax_(inMax > lineMax ? inMax : size_t{lineMax})
+    {
+    }
+
+    int fd() const { return fd_; }
+
+    // Starts over on another fd, -1 while there is none and output is dropped.
+    void attach(int fd)
+    {
+        fd_ = fd;
+        in_.clear();
+        out_.clear();
+    }
+
+    // Reads what arrived as far as the input buffer takes it, false when the peer is gone.
+    bool receive()
+    {
+        char buf[256];
+        while (!full()) {
+            const auto room = inMax_ - in_.size();
+            const auto n = ::read(fd_, buf, room < sizeof(buf) ? room : sizeof(buf));
+            if (n > 0) {
+                take(buf, static_cast<size_t>(n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return n < 0 && errno == EAGAIN;
+        }
+        return true;
+    }
+
+    // Input waits for lines to be taken before the fd is read again.
+    bool full() const { return in_.size() >= inMax_; }
+
+    // Writes buffered output, false when the peer is gone.
+    bool send()
+    {
+        if (fd_ < 0) {
+            out_.clear();
+            return true;
+        }
+        while (!out_.empty()) {
+            const auto n = ::write(fd_, out_.data(), out_.size());
+            if (n > 0) {
+                out_.erase(0, static_cast<size_t>(n));
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return n < 0 && errno == EAGAIN;
+        }
+        return true;
+    }
+
+    bool pending() const { return !out_.empty(); }
+
+    // Takes the next whole line with its end, empty when none arrived yet.
+    std::string line()
+    {
+        const auto end = in_.find('\n');
+        if (end == std::string::npos) {
+            return {};
+        }
+        auto s = in_.substr(0, end + 1);
+        in_.erase(0, end + 1);
+        return s;
+    }
+
+    size_t write(uint8_t c) override
+    {
+        if (out_.size() >= outMax_) {
+            return 0;
+        }
+        out_ += static_cast<char>(c);
+        return 1;
+    }
+
+    int availableForWrite() override { return static_cast<int>(outMax_ - out_.size()); }
+
+    int available() override { return static_cast<int>(in_.size()); }
+
+    int read() override
+    {
+        if (in_.empty()) {
+            return -1;
+        }
+        const auto c = static_cast<uint8_t>(in_[0]);
+        in_.erase(0, 1);
+        return c;
+    }
+
+    int peek() override { return in_.empty() ? -1 : static_cast<uint8_t>(in_[0]); }
+
+private:
+    void take(const char* s, size_t n)
+    {
+        const auto end = in_.rfind('\n');
+        size_t tail = end == std::string::npos ? in_.size() : in_.size() - end - 1;
+        for (size_t i = 0; i < n; ++i) {
+            if (s[i] == '\n') {
+                tail = 0;
+            }
+            else if (tail < lineMax - 1) {
+                ++tail;
+            }
+            else {
+                continue;
+            }
+            in_ += s[i];
+        }
+    }
+
+    int fd_;
+    size_t outMax_;
+    size_t inMax_;
+    std::string in_;
+    std::string out_;
+};
+
+} // namespace gservod
@@ -0,0 +1,330 @@
+#pragma once
+
+// Clients of the Linux daemon: each has its own line parser and reply stream, all of them share
+// the servos, one state read per control tick and the status pushes made from it.
+
+#include "../gservo.h"
+#include "FdStream.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace gservod {
+
+template <int N, typename Ms = typename gservo::Same<gservo::Mx, N>::type>
+class Server {
+public:
+    static constexpr int maxClients = 8;
+
+    explicit Server(DynamixelInterface* bus) : motors_{bus}, cb_{&noneOut_, &motors_}
+    {
+        cb_.pushOutput(&subscribers_);
+    }
+
+    gservo::Motors<N, Ms>& motors() { return motors_; }
+
+    gservo::CallbacksImpl<N, Ms>& callbacks() { return cb_; }
+
+    // The first client gets the boot reply, as it would on the serial link.
+    void begin()
+    {
+        cb_.output(clients_.empty() ? &noneOut_ : &clients_[0]->out);
+        cb_.begin();
+    }
+
+    // False when all places are taken, the fd stays with the caller then.
+    bool add(int fd)
+    {
+        if (clients_.size() >= maxClients) {
+            return false;
+        }
+        clients_.emplace_back(new Client{this, fd});
+        subscribers_.attach(&clients_.back()->out);
+        return true;
+    }
+
+    // Forgets the client, the motion lock is released when it held it. The fd stays with the
+    // caller.
+    void remove(int fd)
+    {
+        for (auto it = clients_.begin(); it != clients_.end(); ++it) {
+            auto& c = **it;
+            if (c.link.fd() != fd) {
+                continue;
+            }
+            if (owner_ == &c.session) {
+                owner_ = nullptr;
+            }
+            if (cb_.output() == &c.out) {
+                cb_.output(&noneOut_);
+            }
+            cb_.forget(&c.out);
+            subscribers_.detach(&c.out);
+            clients_.erase(it);
+            return;
+        }
+    }
+
+    // Takes what arrived from the client, false when it is gone.
+    bool receive(int fd)
+    {
+        auto c = find(fd);
+        return c && c->link.receive();
+    }
+
+    void control() { cb_.control(); }
+
+    // Lines other than ?, stop and tracking samples wait until the motion ends, the output of the
+    // last command is produced and its dwell, program or scan is over. Those three go through for
+    // every client at any time, the work and the held acks stay with the client they are for.
+    // Clients take turns a line at a time, so a long script does not hold the others back.
+    void serve()
+    {
+        for (bool any = true; any;) {
+            any = false;
+            for (auto& c : clients_) {
+                auto& link = c->link;
+                if (!link.available() || !cb_.accepts(link.peek())) {
+                    continue;
+                }
+                const auto line = link.line();
+                if (line.empty()) {
+                    continue;
+                }
+                cb_.output(&c->out);
+                c->parser.parse(line.c_str(), static_cast<int>(line.size()));
+                any = true;
+            }
+        }
+        cb_.background();
+        for (auto& c : clients_) {
+            c->out.drain();
+        }
+        noneOut_.drain();
+        none_.send();
+    }
+
+    // Passes the client output on, false when it is gone.
+    bool send(int fd)
+    {
+        auto c = find(fd);
+        return c && c->link.send();
+    }
+
+    // The client has output which waits for the fd to take it.
+    bool pending(int fd)
+    {
+        auto c = find(fd);
+        return c && c->link.pending();
+    }
+
+    // The client sent more lines than wait to be run, its fd is not read until some are.
+    bool full(int fd)
+    {
+        auto c = find(fd);
+        return c && c->link.full();
+    }
+
+private:
+    // Commands of one client. Whatever moves the servos or changes settings needs the motion lock,
+    // which the first such command takes and %11 or leaving gives back. Stop is for everyone.
+    class Session final : public gservo::Callbacks<N> {
+    public:
+        Session(Server* s, gservo::OutQueue* out) : s_(s), out_(out) {}
+
+        void eol() override
+        {
+            denied_ = false;
+            cb().eol();
+        }
+
+        void homing() override
+        {
+            if (claim()) {
+                cb().homing();
+            }
+        }
+
+        void stop() override { cb().stop(); }
+
+        void setMode(gservo::Mode g) override
+        {
+            if (claim()) {
+                cb().setMode(g);
+            }
+        }
+
+        void setSpeed(float val) override
+        {
+            if (claim()) {
+                cb().setSpeed(val);
+            }
+        }
+
+        void selectProfile(unsigned n) override
+        {
+            if (claim()) {
+                cb().selectProfile(n);
+            }
+        }
+
+        void move(const gservo::FVec<N>& pos, bool report) override
+        {
+            if (claim()) {
+                cb().move(pos, report);
+            }
+        }
+
+        void track(unsigned long ts, const gservo::FVec<N>& pos) override
+        {
+            if (claim()) {
+                cb().track(ts, pos);
+            }
+        }
+
+        void reportCurrentPos() override { cb().reportCurrentPos(); }
+
+        void dwell(unsigned long ms) override
+        {
+            if (claim()) {
+                cb().dwell(ms);
+            }
+        }
+
+        void setSetting(unsigned s, float val, bool hasVal) override
+        {
+            if (claim()) {
+                cb().setSetting(s, val, hasVal);
+            }
+        }
+
+        bool beginProgram(unsigned k) override { return claim() && cb().beginProgram(k); }
+
+        void programLine(const uint8_t* tokens, int len) override
+        {
+            if (claim()) {
+                cb().programLine(tokens, len);
+            }
+        }
+
+        void endProgram() override
+        {
+            if (claim()) {
+                cb().endProgram();
+            }
+        }
+
+        void callProgram(unsigned k, unsigned count, const float* params, int n) override
+        {
+            if (claim()) {
+                cb().callProgram(k, count, params, n);
+            }
+        }
+
+        void listProgram(unsigned k) override { cb().listProgram(k); }
+
+        void scan(const gservo::FVec<N>& span, unsigned pattern) override
+        {
+            if (claim()) {
+                cb().scan(span, pattern);
+            }
+        }
+
+        void showSetting(unsigned s) override { cb().showSetting(s); }
+
+        void showSettings() override { cb().showSettings(); }
+
+        void servoId(unsigned command, int id, int val) override
+        {
+            switch (command) {
+            case 10:
+                claim();
+                return;
+            case 11:
+                if (s_->owner_ == this) {
+                    s_->owner_ = nullptr;
+                }
+                return;
+            case 12:
+                if (id != 0) {
+                    s_->subscribers_.attach(out_);
+                }
+                else {
+                    s_->subscribers_.detach(out_);
+                }
+                return;
+            default:
+                if (command > 2 || claim()) {
+                    cb().servoId(command, id, val);
+                }
+            }
+        }
+
+        void help() override
+        {
+            cb().help();
+            out_->print(F(R"(
+ Daemon:
+%10                      | take the motion lock, the first motion command takes it as well
+%11                      | give the motion lock back
+%12 0                    | stop status pushes and telemetry to this client, %12 1 resumes
+)"));
+        }
+
+        void error(gservo::GStr msg) override { cb().error(msg); }
+
+        void errorPos(char c, int i) override { cb().errorPos(c, i); }
+
+    private:
+        gservo::CallbacksImpl<N, Ms>& cb() { return s_->cb_; }
+
+        // Once per line, the rest of the line is skipped quietly.
+        bool claim()
+        {
+            if (!s_->owner_ || s_->owner_ == this) {
+                s_->owner_ = this;
+                return true;
+            }
+            if (!denied_) {
+                denied_ = true;
+                cb().error(F("motion is locked by another client"));
+            }
+            return false;
+        }
+
+        Server* s_;
+        gservo::OutQueue* out_;
+        bool denied_{};
+    };
+
+    struct Client {
+        Client(Server* s, int fd) : link{fd}, out{&link}, session{s, &out}, parser{&session} {}
+
+        FdStream link;
+        gservo::OutQueue out;
+        Session session;
+        gservo::Parser<N> parser;
+    };
+
+    Client* find(int fd)
+    {
+        for (auto& c : clients_) {
+            if (c->link.fd() == fd) {
+                return c.get();
+            }
+        }
+        return nullptr;
+    }
+
+    gservo::Motors<N, Ms> motors_;
+    // Replies while no client is served, e.g. to a client which left.
+    FdStream none_;
+    gservo::OutQueue noneOut_{&none_};
+    gservo::JoinPrint<maxClients> subscribers_;
+    gservo::CallbacksImpl<N, Ms> cb_;
+    std::vector<std::unique_ptr<Client>> clients_;
+    Session* owner_{};
+};
+
+} // namespace gservod
@@ -0,0 +1,167 @@
+#pragma once
+
+// Servo bus of the Linux daemon: a USB2Dynamixel style adapter seen as a tty. termios2 sets any
+// baud rate, e.g. 250000 which has no B constant, so <termios.h> is not used along with it.
+
+#include <DynamixelInterface.h>
+#include <Print.h>
+
+#include <asm/termbits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/serial.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace gservod {
+
+// Raw 8N1 without flow control, reads return at once. Zero baud keeps the current rate, as a pty
+// has none.
+inline bool rawTty(int fd, unsigned long baud)
+{
+    termios2 t;
+    if (ioctl(fd, TCGETS2, &t) != 0) {
+        return false;
+    }
+    t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+    t.c_oflag &= ~OPOST;
+    t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+    t.c_cflag |= CS8 | CREAD | CLOCAL;
+    if (baud) {
+        t.c_cflag &= ~(CBAUD | CBAUD << IBSHIFT);
+        t.c_cflag |= BOTHER | BOTHER << IBSHIFT;
+        t.c_ispeed = t.c_ospeed = static_cast<speed_t>(baud);
+    }
+    t.c_cc[VMIN] = 0;
+    t.c_cc[VTIME] = 0;
+    return ioctl(fd, TCSETS2, &t) == 0;
+}
+
+// Asks the driver to pass received bytes on at once, for FTDI chips this drops the latency timer
+// from 16 ms to 1 ms. Fails on devices without the setting, e.g. a pty.
+inline bool lowLatency(int fd)
+{
+    serial_struct ss;
+    if (ioctl(fd, TIOCGSERIAL, &ss) != 0) {
+        return false;
+    }
+    ss.flags |= ASYNC_LOW_LATENCY;
+    return ioctl(fd, TIOCSSERIAL, &ss) == 0;
+}
+
+// Writes all of buf to a blocking or non-blocking fd, false on error.
+inline bool writeAll(int fd, const uint8_t* buf, size_t len)
+{
+    while (len) {
+        const auto n = ::write(fd, buf, len);
+        if (n > 0) {
+            buf += n;
+            len -= static_cast<size_t>(n);
+        }
+        else if (n < 0 && errno == EAGAIN) {
+            pollfd p{fd, POLLOUT, 0};
+            ::poll(&p, 1, -1);
+        }
+        else if (n < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Half duplex bus on a tty, the adapter switches direction by itself and does not echo.
+class TtyBus final : public DynamixelInterface {
+public:
+    TtyBus() = default;
+
+    ~TtyBus() override { close(); }
+
+    TtyBus(const TtyBus&) = delete;
+    TtyBus& operator=(const TtyBus&) = delete;
+
+    // False with errno set when the device does not open or is not a tty.
+    bool open(const char* path)
+    {
+        close();
+        fd_ = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        if (fd_ < 0) {
+            return false;
+        }
+        if (!rawTty(fd_, 0)) {
+            close();
+            return false;
+        }
+        lowLatency(fd_);
+        return true;
+    }
+
+    void close()
+    {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    void begin(unsigned long baud, unsigned long timeout = 50) override
+    {
+        baud_ = baud;
+        timeoutUs_ = timeout * 1000;
+        if (fd_ >= 0 && !rawTty(fd_, baud)) {
+            // A pty takes no rate, the rest of the settings stay.
+            rawTty(fd_, 0);
+        }
+    }
+
+    // Stale bytes, e.g. a late reply to a timed out request, are dropped first. The timeout
+    // starts when the request is on the wire.
+    size_t transfer(const uint8_t* tx, size_t txLen, uint8_t* rx, size_t rxLen) override
+    {
+        if (fd_ < 0) {
+            return 0;
+        }
+        ioctl(fd_, TCFLSH, TCIFLUSH);
+        if (!writeAll(fd_, tx, txLen)) {
+            return 0;
+        }
+        const auto deadline = micros() + wireUs(txLen + rxLen) + timeoutUs_;
+        size_t got = 0;
+        while (got < rxLen) {
+            const auto n = ::read(fd_, rx + got, rxLen - got);
+            if (n > 0) {
+                got += static_cast<size_t>(n);
+                continue;
+            }
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                break;
+            }
+            const auto now = micros();
+            if (static_cast<long>(deadline - now) <= 0) {
+                break;
+            }
+            const auto left = deadline - now;
+            pollfd p{fd_, POLLIN, 0};
+            const timespec ts{static_cast<time_t>(left / 1000000),
+                              static_cast<long>(left % 1000000 * 1000)};
+            ::ppoll(&p, 1, &ts, nullptr);
+        }
+        return got;
+    }
+
+    int fd() const { return fd_; }
+
+private:
+    // Start bit, 8 data bits and stop bit.
+    unsigned long wireUs(size_t bytes) const
+    {
+        return baud_ ? bytes * 10000000ul / baud_ : 0;
+    }
+
+    int fd_{-1};
+    unsigned long baud_{};
+    unsigned long timeoutUs_{50000};
+};
+
+} // namespace gservod
@@ -0,0 +1,372 @@
+// The firmware as a Linux daemon on the rig PC: servos on a USB serial adapter, commands on a pty
+// or from several clients of a Unix socket, one epoll loop for the clients, the control tick and
+// signals.
+//
+//   gservod -d /dev/ttyUSB0 -p /tmp/gservo        servos on the adapter, commands on a pty
+//   gservod -l /tmp/gservo.sock -e gservo.eep     simulated servos, commands on a socket
+
+#include "../gservo.h"
+#include "Server.h"
+#include "Tty.h"
+
+#include <DynamixelSim.h>
+#include <EEPROM.h>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef GSERVOD_AXES
+#define GSERVOD_AXES 2
+#endif
+
+constexpr int AXES = GSERVOD_AXES;
+
+namespace gservo {
+template <>
+Set<AXES> defSettings<AXES>()
+{
+    // Status reports while moving, as host clients expect them.
+    auto s = baseSettings<AXES>();
+    s.reportMoving_ = 200;
+    return s;
+}
+} // namespace gservo
+
+namespace {
+using namespace gservod;
+
+struct Options {
+    const char* tty = nullptr;
+    unsigned long baud = 1000000;
+    const char* pty = nullptr;
+    const char* socket = nullptr;
+    const char* eeprom = nullptr;
+    unsigned long periodUs = 20000;
+};
+
+void usage()
+{
+    fprintf(stderr, R"(usage: gservod [-d tty] [-b baud] (-p link | -l socket) [-e file] [-t ms]
+ -d tty     servo bus adapter, simulated servos without it
+ -b baud    servo bus baud rate, 1000000 by default
+ -p link    commands on a pty, its name is linked from here
+ -l socket  commands on a Unix socket at this path, up to 8 clients
+ -e file    settings kept in this file, as in the EEPROM
+ -t ms      control period, 20 by default
+)");
+}
+
+// Settings survive restarts in a file image of the EEPROM.
+class EepromFile {
+public:
+    explicit EepromFile(const char* path) : path_(path)
+    {
+        if (!path_) {
+            return;
+        }
+        if (FILE* f = fopen(path_, "rb")) {
+            if (fread(host::eeprom(), 1, host::eepromSize, f) != host::eepromSize) {
+                host::eraseEeprom();
+            }
+            fclose(f);
+        }
+        memcpy(saved_, host::eeprom(), sizeof(saved_));
+    }
+
+    // Writes the image when it changed, through a temporary file so a crash keeps the old one.
+    void sync()
+    {
+        if (!path_ || memcmp(saved_, host::eeprom(), sizeof(saved_)) == 0) {
+            return;
+        }
+        const std::string tmp = std::string(path_) + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if (!f) {
+            perror(tmp.c_str());
+            return;
+        }
+        const bool ok = fwrite(host::eeprom(), 1, host::eepromSize, f) == host::eepromSize;
+        if (fclose(f) != 0 || !ok || rename(tmp.c_str(), path_) != 0) {
+            perror(path_);
+            return;
+        }
+        memcpy(saved_, host::eeprom(), sizeof(saved_));
+    }
+
+private:
+    const char* path_;
+    uint8_t saved_[host::eepromSize];
+};
+
+// Raw pty whose slave name is linked from the given path. The daemon keeps the slave open too, so
+// the master stays readable when a client closes it.
+int openPty(const char* link)
+{
+    const int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        return -1;
+    }
+    const char* name = ptsname(fd);
+    const int slave = name ? open(name, O_RDWR | O_NOCTTY | O_CLOEXEC) : -1;
+    if (slave < 0 || !rawTty(slave, 0)) {
+        return -1;
+    }
+    unlink(link);
+    if (symlink(name, link) != 0) {
+        return -1;
+    }
+    fprintf(stderr, "gservod: commands on %s -> %s\n", link, name);
+    return fd;
+}
+
+int listenUnix(const char* path)
+{
+    sockaddr_un a{};
+    a.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(a.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(a.sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&a), sizeof(a)) != 0 || listen(fd, 4) != 0) {
+        return -1;
+    }
+    fprintf(stderr, "gservod: commands on %s\n", path);
+    return fd;
+}
+
+// Main loop of the sketch driven by events: the control tick comes from a timer, command lines
+// when they arrive and output goes whenever a client takes it, the process sleeps in between.
+class Daemon {
+public:
+    Daemon(DynamixelInterface* bus, const Options& o) : server_{bus}, eeprom_{o.eeprom}
+    {
+        epoll_ = epoll_create1(EPOLL_CLOEXEC);
+        timer_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        const itimerspec period{{static_cast<time_t>(o.periodUs / 1000000),
+                                 static_cast<long>(o.periodUs % 1000000 * 1000)},
+                                {0, 1}};
+        timerfd_settime(timer_, 0, &period, nullptr);
+        watch(timer_, EPOLLIN);
+        sigset_t s;
+        sigemptyset(&s);
+        sigaddset(&s, SIGINT);
+        sigaddset(&s, SIGTERM);
+        sigprocmask(SIG_BLOCK, &s, nullptr);
+        signals_ = signalfd(-1, &s, SFD_NONBLOCK | SFD_CLOEXEC);
+        watch(signals_, EPOLLIN);
+    }
+
+    // False with errno set when the link can not be made. The pty is the one client for good.
+    bool open(const Options& o)
+    {
+        if (o.pty) {
+            const int fd = openPty(o.pty);
+            if (fd < 0) {
+                return false;
+            }
+            add(fd);
+            return true;
+        }
+        listen_ = listenUnix(o.socket);
+        if (listen_ < 0) {
+            return false;
+        }
+        watch(listen_, EPOLLIN);
+        return true;
+    }
+
+    int run()
+    {
+        server_.callbacks().boot().mark(gservo::BootLog::Baud);
+        server_.begin();
+        serve();
+        for (;;) {
+            epoll_event ev[8];
+            const int n = epoll_wait(epoll_, ev, 8, -1);
+            if (n < 0 && errno != EINTR) {
+                perror("epoll_wait");
+                return 1;
+            }
+            for (int i = 0; i < n; ++i) {
+                const int fd = ev[i].data.fd;
+                if (fd == signals_) {
+                    eeprom_.sync();
+                    return 0;
+                }
+                if (fd == timer_) {
+                    uint64_t ticks;
+                    while (read(timer_, &ticks, sizeof(ticks)) > 0) {
+                    }
+                    server_.control();
+                }
+                else if (fd == listen_) {
+                    accept();
+                }
+                // A client whose input is full is not read, it is dropped when it hangs up.
+                else if ((ev[i].events & EPOLLIN) ? !server_.receive(fd)
+                                                  : (ev[i].events & (EPOLLHUP | EPOLLERR)) != 0) {
+                    drop(fd);
+                }
+            }
+            serve();
+            eeprom_.sync();
+        }
+    }
+
+private:
+    void watch(int fd, uint32_t events, int op = EPOLL_CTL_ADD)
+    {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_, op, fd, &ev);
+    }
+
+    void add(int fd)
+    {
+        server_.add(fd);
+        clients_.push_back({fd, EPOLLIN});
+        watch(fd, EPOLLIN);
+    }
+
+    void accept()
+    {
+        const int fd = accept4(listen_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        if (clients_.size() >= decltype(server_)::maxClients) {
+            static const char full[] = "[MSG:Too many clients]\n";
+            (void)!write(fd, full, sizeof(full) - 1);
+            close(fd);
+            return;
+        }
+        add(fd);
+    }
+
+    void drop(int fd)
+    {
+        if (listen_ < 0) {
+            return;
+        }
+        server_.remove(fd);
+        epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        for (auto it = clients_.begin(); it != clients_.end(); ++it) {
+            if (it->fd == fd) {
+                clients_.erase(it);
+                return;
+            }
+        }
+    }
+
+    // Commands, background output and the output to the fds, waiting for room when one is full.
+    // A client whose lines wait to be run is not read until they are, it waits on its socket.
+    void serve()
+    {
+        server_.serve();
+        for (size_t i = 0; i < clients_.size();) {
+            auto& c = clients_[i];
+            if (!server_.send(c.fd) && listen_ >= 0) {
+                drop(c.fd);
+                continue;
+            }
+            uint32_t events = server_.full(c.fd) ? 0u : uint32_t{EPOLLIN};
+            if (server_.pending(c.fd)) {
+                events |= EPOLLOUT;
+            }
+            if (events != c.events) {
+                watch(c.fd, events, EPOLL_CTL_MOD);
+                c.events = events;
+            }
+            ++i;
+        }
+    }
+
+    struct Client {
+        int fd;
+        uint32_t events;
+    };
+
+    Server<AXES> server_;
+    EepromFile eeprom_;
+    std::vector<Client> clients_;
+    int epoll_{-1};
+    int timer_{-1};
+    int signals_{-1};
+    int listen_{-1};
+};
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options o;
+    for (int c; (c = getopt(argc, argv, "d:b:p:l:e:t:h")) != -1;) {
+        switch (c) {
+        case 'd':
+            o.tty = optarg;
+            break;
+        case 'b':
+            o.baud = strtoul(optarg, nullptr, 10);
+            break;
+        case 'p':
+            o.pty = optarg;
+            break;
+        case 'l':
+            o.socket = optarg;
+            break;
+        case 'e':
+            o.eeprom = optarg;
+            break;
+        case 't':
+            o.periodUs = strtoul(optarg, nullptr, 10) * 1000;
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (!o.pty == !o.socket || o.periodUs == 0) {
+        usage();
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    host::Clock::realTime(true);
+
+    std::unique_ptr<DynamixelInterface> bus;
+    if (o.tty) {
+        auto tty = std::unique_ptr<TtyBus>(new TtyBus);
+        if (!tty->open(o.tty)) {
+            perror(o.tty);
+            return 1;
+        }
+        bus = std::move(tty);
+    }
+    else {
+        bus.reset(new host::SimBus{AXES});
+    }
+    bus->begin(o.baud);
+
+    std::unique_ptr<Daemon> d{new Daemon{bus.get(), o}};
+    if (!d->open(o)) {
+        perror(o.pty ? o.pty : o.socket);
+        return 1;
+    }
+    return d->run();
+}
@@ -1,50 +1,131 @@
+// 1 adds loop timing shown by %5, at the cost of about 200 bytes of RAM.
+#define GSERVO_PROFILE 0
+
 #include "DynamixelMotor.h"
 #include "SoftwareSerial.h"
 
 #include "gservo.h"
 
+// Servo ids are 1..AXES, axes are named x, y, z, a, b, c.
+constexpr int AXES = 2;
+
 namespace gservo {
-Set defSettings()
+template <>
+Set<AXES> defSettings<AXES>()
 {
+    using V = FVec<AXES>;
     return {
             0.0f,                       // homing pull off, deg            
-            FVec{15000.0f, 15000.0f},   // speed, {x,y}, deg/min
-            FVec{2000.0f, 2000.0f},     // acceleration, {x,y}, deg/sec^2
-            FVec{0.0f, 0.0f},           // zero position, {x,y}, deg
-            FVec::ofConst(0.05f),       // proportional gain
-            FVec::ofConst(0.0f),        // integral gain 
-            FVec::ofConst(0.01f),       // derivative gain
-            FVec::ofConst(0.0f),        // punch
-            FVec::ofConst(1.0f),        // torque            
+            V::ofConst(15000.0f),       // speed, deg/min
+            V::ofConst(2000.0f),        // acceleration, deg/sec^2
+            V::ofConst(0.0f),           // zero position, deg
+            V::ofConst(0.05f),          // proportional gain
+            V::ofConst(0.0f),           // integral gain 
+            V::ofConst(0.01f),          // derivative gain
+            V::ofConst(0.0f),           // punch
+            V::ofConst(1.0f),           // torque            
             2,                          // direction invert mask
+            0,                          // push status report while moving, ms, 0 is off
+            0,                          // push status report while idle, ms
+            0,                          // binary telemetry period, ms
+            0,                          // active tuning profile
+            30,                         // tracking lead, ms
+            0.5f,                       // tracking position gain
+            0.1f,                       // tracking velocity gain
+            200,                        // tracking ends without samples for, ms
+            0.1f,                       // motion ends within, deg of the goal
+            50,                         // motion ends below, deg/min
+            2,                          // motion ends after reads in a row
+            0,                          // read servo state while moving, ms, 0 is every tick
+            500,                        // read servo state at rest, ms
+            0.3f,                       // scan overlap of neighbour pictures
+            200,                        // scan settle after the end of motion, ms
+            100,                        // shutter pulse, ms
+            500,                        // scan exposure from the shutter pulse, ms
+            0,                          // shutter pin, 0 is none
+            V::ofConst(30.0f),          // camera field of view, deg
     };
 }
 }
 
 const unsigned long dynamixel_baudrate = 1000000;
 const unsigned long serial_baudrate = 9600;
+// State of two servos at 9600 baud takes about 55 ms to read, the rest of the period is left for
+// a command line, whose parse sends its servo packets at the same baud rate.
+const unsigned long control_period_us = 100000;
+const uint16_t rx_budget_us = 30000;
+
+// Servo model per axis, e.g. gservo::Models<gservo::Mx, gservo::Ax> for MX on x and AX on y.
+using Servos = gservo::Same<gservo::Mx, AXES>::type;
 
 SoftwareDynamixelInterface di_{2, 3};
-gservo::Motors motors_{&di_};
-gservo::CallbacksImpl cb_{&Serial, &motors_};
-gservo::Parser parser_{&cb_};
+gservo::Motors<AXES, Servos> motors_{&di_};
+gservo::OutQueue out_{&Serial};
+gservo::CallbacksImpl<AXES, Servos> cb_{&out_, &motors_};
+gservo::Parser<AXES> parser_{&cb_};
+gservo::Scheduler<4> sched_;
+// Command line being received, it is parsed when its '\n' has come.
+char rxLine_[128] {};
+uint8_t rxLen_ = 0;
+
+// Static RAM of the firmware objects, the core serial buffers come on top. avr-size shows the
+// total of the build, %9 how close the stack came to the heap at run time.
+constexpr size_t ram_static = sizeof(di_) + sizeof(motors_) + sizeof(out_) + sizeof(cb_) +
+                              sizeof(parser_) + sizeof(sched_) + sizeof(rxLine_);
+static_assert(ram_static <= GSERVO_RAM_BUDGET, "firmware objects exceed GSERVO_RAM_BUDGET");
+
+// Lines other than ?, stop and tracking samples wait until the motion ends, the previous output
+// is produced and a dwell is over. Only bytes already received are taken, the rest of a line
+// comes on later passes, so the task never waits for the link. Bytes past the buffer are dropped.
+void rxTask(void*) {
+  while (Serial.available()) {
+    const int c = Serial.peek();
+    if (rxLen_ == 0 && !cb_.accepts(c)) {
+      return;
+    }
+    Serial.read();
+    if (c == '\n') {
+      rxLine_[rxLen_] = '\n';
+      const int len = rxLen_;
+      rxLen_ = 0;
+      GSERVO_PROFILE_SCOPE(cb_.profiler(), Parse);
+      parser_.parse(rxLine_, len);
+      return;
+    }
+    if (rxLen_ < sizeof(rxLine_) - 1) {
+      rxLine_[rxLen_++] = static_cast<char>(c);
+    }
+  }
+}
+
+void controlTask(void*) { cb_.control(); }
+
+void backgroundTask(void*) { cb_.background(); }
+
+void drainTask(void*) {
+  GSERVO_PROFILE_SCOPE(cb_.profiler(), Drain);
+  out_.drain();
+}
 
 void setup() {  
+  gservo::sram::paintStack();
   Serial.begin(serial_baudrate);    
   di_.begin(dynamixel_baudrate);
   motors_.changeBaud();
   di_.begin(serial_baudrate);
   motors_.led(true);
+  cb_.boot().mark(gservo::BootLog::Baud);
   cb_.begin();
   motors_.led(false);
+  // Name, task, period us, priority with 0 the most urgent, time budget us. Planner or health
+  // polling go here as further tasks, the control tick keeps its period whatever is added.
+  sched_.add(F("control"), controlTask, nullptr, control_period_us, 0, 60000);
+  sched_.add(F("rx"), rxTask, nullptr, 0, 1, rx_budget_us);
+  sched_.add(F("background"), backgroundTask, nullptr, 0, 2, 5000);
+  sched_.add(F("drain"), drainTask, nullptr, 0, 3, 2000);
+  cb_.tasks(&sched_);
 }
 
 void loop() {
-  char buff[128] {};
-  if (Serial.available() && (Serial.peek() == '?' || !motors_.isMoving())) {    
-      const auto read = Serial.readBytesUntil('\n', buff, 127);
-      buff[read] = '\n';
-      parser_.parse(buff, read);
-  } 
-  cb_.loop();
+  sched_.run();
 }
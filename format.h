@@ -0,0 +1,166 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#ifndef GSERVO_DECIMALS
+#define GSERVO_DECIMALS 2
+#endif
+
+namespace gservo {
+
+constexpr uint8_t maxDecimals = 4;
+
+constexpr size_t fixedMax = 16;
+
+// Formats value with given number of decimals into buf of at least fixedMax bytes without float
+// division, returns length. Values out of 32 bit fixed point range are written as "ovf".
+inline size_t formatFixed(char* buf, float val, uint8_t decimals = GSERVO_DECIMALS)
+{
+    static const float scale[maxDecimals + 1]{1.f, 10.f, 100.f, 1000.f, 10000.f};
+    if (isnan(val)) {
+        memcpy(buf, "nan", 3);
+        return 3;
+    }
+    decimals = decimals > maxDecimals ? maxDecimals : decimals;
+    const float scaled = fabsf(val) * scale[decimals] + 0.5f;
+    if (!(scaled < 4294967040.f)) {
+        memcpy(buf, "ovf", 3);
+        return 3;
+    }
+    auto fixed = static_cast<uint32_t>(scaled);
+    char tmp[fixedMax];
+    size_t n = 0;
+    do {
+        tmp[n++] = static_cast<char>('0' + fixed % 10u);
+        fixed /= 10u;
+        if (n == decimals) {
+            tmp[n++] = '.';
+        }
+    } while (fixed || n <= decimals);
+    if (tmp[n - 1] == '.') {
+        tmp[n++] = '0';
+    }
+    size_t len = 0;
+    if (val < 0 && static_cast<uint32_t>(scaled) != 0) {
+        buf[len++] = '-';
+    }
+    while (n) {
+        buf[len++] = tmp[--n];
+    }
+    return len;
+}
+
+// Fixed size line builder, emitted to Print with a single bulk write.
+template <size_t Size>
+class StrBuf {
+public:
+    StrBuf& add(char c)
+    {
+        if (len_ < Size) {
+            buf_[len_++] = c;
+        }
+        else {
+            overflow_ = true;
+        }
+        return *this;
+    }
+
+    StrBuf& add(GStr s)
+    {
+        auto p = reinterpret_cast<const char*>(s);
+        for (char c; (c = static_cast<char>(pgm_read_byte(p))); ++p) {
+            add(c);
+        }
+        return *this;
+    }
+
+    StrBuf& add(unsigned long v)
+    {
+        char tmp[10];
+        size_t n = 0;
+        do {
+            tmp[n++] = static_cast<char>('0' + v % 10u);
+            v /= 10u;
+        } while (v);
+        while (n) {
+            add(tmp[--n]);
+        }
+        return *this;
+    }
+
+    StrBuf& add(long v)
+    {
+        if (v < 0) {
+            add('-');
+            return add(0ul - static_cast<unsigned long>(v));
+        }
+        return add(static_cast<unsigned long>(v));
+    }
+
+    StrBuf& add(unsigned v) { return add(static_cast<unsigned long>(v)); }
+
+    StrBuf& add(int v) { return add(static_cast<long>(v)); }
+
+    StrBuf& fixed(float v, uint8_t decimals = GSERVO_DECIMALS)
+    {
+        if (len_ + fixedMax > Size) {
+            char tmp[fixedMax];
+            const auto n = formatFixed(tmp, v, decimals);
+            for (size_t i = 0; i < n; ++i) {
+                add(tmp[i]);
+            }
+        }
+        else {
+            len_ += formatFixed(buf_ + len_, v, decimals);
+        }
+        return *this;
+    }
+
+    // Values joined with separator, as in position reports.
+    template <typename T, int N>
+    StrBuf& fixed(const Vec<T, N>& v, char sep = ',', uint8_t decimals = GSERVO_DECIMALS)
+    {
+        for (int i = 0; i < N; ++i) {
+            if (i) {
+                add(sep);
+            }
+            fixed(v[i], decimals);
+        }
+        return *this;
+    }
+
+    void clear()
+    {
+        len_ = 0;
+        overflow_ = false;
+    }
+
+    // Drops everything after mark, to reuse precomputed prefix of a template.
+    void truncate(size_t mark)
+    {
+        len_ = mark < len_ ? mark : len_;
+        overflow_ = false;
+    }
+
+    const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(buf_); }
+
+    const char* c_str()
+    {
+        buf_[len_ < Size ? len_ : Size] = 0;
+        return buf_;
+    }
+
+    size_t size() const { return len_; }
+
+    bool overflow() const { return overflow_; }
+
+private:
+    char buf_[Size + 1]{};
+    size_t len_{};
+    bool overflow_{};
+};
+
+} // namespace gservo
@@ -1,252 +1,156 @@
 #pragma once
 
+#include "format.h"
+#include "models.h"
+#include "output.h"
 #include "parser.h"
+#include "profiler.h"
+#include "program.h"
+#include "scan.h"
+#include "scheduler.h"
+#include "settings.h"
+#include "sram.h"
+#include "telemetry.h"
+#include "tracker.h"
 
 #include <DynamixelMotor.h>
-#include <EEPROM.h>
 #include <Print.h>
 
 namespace gservo {
 
-class JoinPrint final : public Print {
-public:
-    JoinPrint(Print* s1, Print* s2) : s1_(s1), s2_(s2) {}
-
-    size_t write(uint8_t uint8) override
-    {
-        const auto w1 = s1_->write(uint8);
-        const auto w2 = s2_->write(uint8);
-        return min(w1, w2);
-    }
-
-private:
-    Print *s1_, *s2_;
-};
+// Servos of N axes with ids 1..N, Ms are their per-axis model traits.
+template <int N, typename Ms = typename Same<Mx, N>::type>
+class Motors {
+    static_assert(Ms::count == N, "one model per axis");
 
-struct Set {
-    float homingPullOff_;
-    FVec speed_;
-    FVec accel_;
-    FVec zero_;
-    FVec p_;
-    FVec i_;
-    FVec d_;
-    FVec punch_;
-    FVec torque_;
-	float dirInvert_;
-};
+public:
+    using MVec = Vec<int16_t, N>;
 
-Set defSettings();
+    // Servo objects are members, so their RAM is known at compile time and no heap is used.
+    Motors(DynamixelInterface* di) : Motors(di, typename reg::MakeSeq<N>::type{}) {}
 
-struct Reg {
-    Reg(Set* set)
+    // Each servo is pinged, as the library learns its status return level. Joint mode limits live
+    // in the servo EEPROM, they are read back and written only to servos which differ, in one
+    // broadcast write when all servos need the same ones.
+    void init()
     {
-        int it = 0;
-        const auto add = [&](unsigned s, float* f) { items[it++] = Item{s, f}; };
-        add(27, &set->homingPullOff_);
-		add(3, &set->dirInvert_);
-        for (unsigned i = 0; i < COORDS; ++i) {
-            add(110 + i, &set->speed_[i]);
-            add(120 + i, &set->accel_[i]);
-            add(140 + i, &set->zero_[i]);
-            add(200 + i, &set->p_[i]);
-            add(210 + i, &set->i_[i]);
-            add(220 + i, &set->d_[i]);
-            add(230 + i, &set->punch_[i]);
-            add(240 + i, &set->torque_[i]);
+        s_ = DYN_STATUS_OK;
+        for (auto& m : motor_) {
+            s_ |= m.init();
         }
-        sort();
-    }
-
-    float get(unsigned s)
-    {
-        for (const auto& it : items) {
-            if (it.snum == s) {
-                return *it.f;
+        uint8_t differ = 0;
+        for (int i = 0; i < N; ++i) {
+            uint32_t curr{};
+            if (di_->read(motorId(i), Ms::regLimits, curr) & DYN_STATUS_COM_ERROR
+                || curr != limits(i)) {
+                differ |= 1u << i;
             }
         }
-        return NAN;
-    }
-
-    bool set(unsigned s, float val)
-    {
-        for (const auto& it : items) {
-            if (it.snum == s) {
-                *it.f = val;
-				return true;
-            }
+        if (Ms::sameLimits && differ == (1u << N) - 1) {
+            s_ |= di_->write(BROADCAST_ID, Ms::regLimits, limits(0));
+            return;
         }
-		return false;
-    }
-
-    bool anyNan()
-    {
-        for (const auto& it : items) {
-            if (isnan(*it.f)) {
-                return true;
+        for (int i = 0; i < N; ++i) {
+            if (differ >> i & 1) {
+                s_ |= motor_[i].write(Ms::regLimits, limits(i));
             }
         }
-        return false;
     }
 
-    void print(Print& p)
+    // RAM registers are lost on servo power cycle, they go in one burst. Torque max lives in the
+    // servo EEPROM, with onlyChanged it is read first and written only when differs, so unchanged
+    // settings after power cycle cost one short read per servo and no EEPROM wear. Protocol 1.0
+    // has no sync read and AX servos do not answer the MX bulk read, so the reads stay per servo.
+    void updateSettings(const Set<N>& s, bool onlyChanged = false)
     {
-        sort();
-        for (const auto& it : items) {
-            if (it.snum == 0) {
-                return;
+        burstSettings(s);
+        ServoSettings ss[N];
+        servoSettings(s, ss);
+        for (int i = 0; i < N; ++i) {
+            uint16_t curr{};
+            if (onlyChanged
+                && !(di_->read(motorId(i), Ms::regTorqueMax, curr) & DYN_STATUS_COM_ERROR)
+                && curr == ss[i].torque) {
+                continue;
             }
-            printOne(p, it.snum, *it.f);
+            s_ |= motor_[i].write(Ms::regTorqueMax, ss[i].torque);
         }
     }
 
-private:
-    void printOne(Print& p, unsigned s, float val)
-    {
-        p.print('$');
-        p.print(s);
-        p.print('=');
-        p.print(val);
-        p.print('\n');
-    }
-
-    int itemsLen()
+    // Settings in servo RAM, all servos get new values at once with one sync write per group of
+    // adjacent registers and no replies, whatever the number of axes. Gains and acceleration go
+    // only to servos which have them.
+    void burstSettings(const Set<N>& s)
     {
-        for (int i = 0; i < size; ++i) {
-            if (items[i].snum == 0) {
-                return i;
-            }
+        arrival(s);
+        s_ = DYN_STATUS_OK;
+        ServoSettings ss[N];
+        servoSettings(s, ss);
+        uint8_t ids[N];
+        uint8_t speedTorque[N][4];
+        uint8_t punch[N][2];
+        for (int i = 0; i < N; ++i) {
+            const auto& v = ss[i];
+            ids[i] = motorId(i);
+            speedTorque[i][0] = 0;
+            speedTorque[i][1] = 0;
+            speedTorque[i][2] = static_cast<uint8_t>(v.torque);
+            speedTorque[i][3] = static_cast<uint8_t>(v.torque >> 8);
+            punch[i][0] = static_cast<uint8_t>(v.punch);
+            punch[i][1] = static_cast<uint8_t>(v.punch >> 8);
         }
-        return 0;
-    }
-
-    void sort()
-    {
-        const int len = itemsLen();
-        for (int i = 1; i < len; i++) {
-            int j = i;
-            while (j > 0 && items[j - 1].snum > items[j].snum) {
-                auto tmp = items[j];
-                items[j] = items[j - 1];
-                items[j - 1] = tmp;
-                j--;
+        s_ |= di_->syncWrite(N, ids, Ms::regSpeed, 4, speedTorque[0]);
+        s_ |= di_->syncWrite(N, ids, Ms::regPunch, 2, punch[0]);
+        if (Ms::anyPid) {
+            uint8_t pidIds[N];
+            uint8_t gains[N][3];
+            uint8_t n = 0;
+            for (int i = 0; i < N; ++i) {
+                if (Ms::hasPid[i]) {
+                    pidIds[n] = ids[i];
+                    gains[n][0] = ss[i].d;
+                    gains[n][1] = ss[i].i;
+                    gains[n][2] = ss[i].p;
+                    ++n;
+                }
             }
+            s_ |= di_->syncWrite(n, pidIds, Ms::regGains, 3, gains[0]);
         }
-    }
-
-    struct Item {
-        unsigned snum;
-        float* f;
-    };
-
-    static constexpr int size = 32;
-    Item items[size]{};
-};
-
-namespace MotorsConstAx {
-constexpr float unitRpm = 0.111f;
-constexpr float unitDegPerSec = unitRpm * 360.f / 60.f;
-constexpr float unitDegPerSecInv = 1.f / unitDegPerSec;
-
-constexpr float unitDeg = 300.f / 1023.f;
-constexpr float unitDegInv = 1.f / unitDeg;
-
-constexpr float unitDegPerSec2 = 0;
-constexpr float unitDegPerSec2Inv = 0;
-
-constexpr int16_t maxPos = 1023;
-constexpr int16_t maxSpeed = 1023;
-constexpr int16_t maxAcc = 0;
-} // namespace MotorsConstAx
-
-namespace MotorsConstMx {
-constexpr float unitRpm = 0.916f;
-constexpr float unitDegPerMin = unitRpm * 360.f;
-constexpr float unitDegPerMinInv = 1.f / unitDegPerMin;
-
-constexpr float unitDeg = 0.088f;
-constexpr float unitDegInv = 1.f / unitDeg;
-
-constexpr float unitDegPerSec2 = 8.583f;
-constexpr float unitDegPerSec2Inv = 1.f / unitDegPerSec2;
-
-constexpr int16_t maxPos = 0xFFF;
-constexpr int16_t maxSpeed = 1023;
-constexpr float maxSpeedDegPerSec = maxSpeed * unitDegPerMin;
-constexpr int16_t maxAcc = 254;
-constexpr float maxAccDegPerSec2 = maxAcc * unitDegPerSec2;
-} // namespace MotorsConstMx
-
-namespace MotorsConst = MotorsConstMx;
-
-class Motors {
-public:
-    using MVec = Vec<int16_t>;
-
-    Motors(DynamixelInterface* di) : di_(di)
-    {
-        for (int i = 0; i < COORDS; ++i) {
-            const auto id = static_cast<DynamixelID>(i + 1);
-            motor_[i] = new DynamixelMotor(*di_, id);
-        }
-    }
-
-    ~Motors()
-    {
-        for (auto& m : motor_) {
-            delete m;
-        }
-    }
-
-    void init()
-    {
-        s_ = DYN_STATUS_OK;
-        for (auto m : motor_) {
-            s_ |= m->init();
-            m->jointMode(MotorsConst::maxPos, MotorsConst::maxPos);
-        }
-    }
-
-    void updateSettings(const Set& s)
-    {
-        s_ = DYN_STATUS_OK;
-        const auto mAcc = clampEach((s.accel_ * MotorsConstMx::unitDegPerSec2Inv).round<uint8_t>(),
-                                    0u,
-                                    MotorsConst::maxAcc);
-        const auto pGain = clampEach((s.p_ * 254.f).round<uint8_t>(), 0u, 254u);
-        const auto iGain = clampEach((s.i_ * 254.f).round<uint8_t>(), 0u, 254u);
-        const auto dGain = clampEach((s.d_ * 254.f).round<uint8_t>(), 0u, 254u);
-        const auto punch = clampEach((s.punch_ * 1023.f).round<uint16_t>(), 0u, 1023u);
-        const auto torque = clampEach((s.torque_ * 1023.f).round<uint16_t>(), 0u, 1023u);
-        for (int i = 0; i < COORDS; ++i) {
-            auto m = motor_[i];
-            s_ |= m->write(0X20, uint16_t{0});
-            s_ |= m->write(0X49, mAcc[i]);
-            s_ |= m->write(0X1A, dGain[i]);
-            s_ |= m->write(0X1B, iGain[i]);
-            s_ |= m->write(0X1C, pGain[i]);
-            s_ |= m->write(0X30, punch[i]);
-            s_ |= m->write(0X22, torque[i]);
-            s_ |= m->write(0X0E, torque[i]);
+        if (Ms::anyAcc) {
+            uint8_t accIds[N];
+            uint8_t acc[N];
+            uint8_t n = 0;
+            for (int i = 0; i < N; ++i) {
+                if (Ms::hasAcc[i]) {
+                    accIds[n] = ids[i];
+                    acc[n] = static_cast<uint8_t>(ss[i].acc);
+                    ++n;
+                }
+            }
+            s_ |= di_->syncWrite(n, accIds, Ms::regAcc, 1, acc);
         }
     }
 
     void enable(bool b, int coord = -1)
     {
+        // A servo without torque stays where it is pushed, not at its goal.
+        if (!b) {
+            goalSet_ &= coord < 0 ? 0 : ~(1u << coord);
+        }
         if (coord < 0) {
             s_ = di_->write(BROADCAST_ID, DYN_ADDRESS_ENABLE_TORQUE, static_cast<uint8_t>(b));
         }
         else {
-            motor_[coord]->enableTorque(b);
+            motor_[coord].enableTorque(b);
         }
     }
 
 	bool isEnabled(int coord = -1) {
 		s_ = DYN_STATUS_OK;
 		if(coord < 0) {
-			for (int i = 0; i < COORDS; ++i) {
+			for (int i = 0; i < N; ++i) {
 				uint8_t en{};
-				s_ |= motor_[i]->read(DYN_ADDRESS_ENABLE_TORQUE, en); 
+				s_ |= motor_[i].read(DYN_ADDRESS_ENABLE_TORQUE, en); 
 				if(!en){
 					return false;
 				}
@@ -254,23 +158,62 @@ public:
 			return true;
 		}
 		uint8_t en{};
-		s_ |= motor_[coord]->read(DYN_ADDRESS_ENABLE_TORQUE, en); 
+		s_ |= motor_[coord].read(DYN_ADDRESS_ENABLE_TORQUE, en); 
 		return en;
 	}
 	
-    void loop() { 
-		currPos_ = motorCurrentPos(); 
-		isMoving_ = motorIsMoving();
-	}
+    void loop()
+    {
+        readState();
+        stateMs_ = millis();
+    }
+
+    // Present values of every servo read by the last loop.
+    const ServoState* state() const { return state_; }
+
+    unsigned long stateMs() const { return stateMs_; }
 
-    void move(const FVec& goal, const FVec& speed)
+    void move(const FVec<N>& goal, const FVec<N>& speed)
     {
-        const auto mSpeed = convSpeed(clampEach(speed, 0.f, MotorsConst::maxSpeedDegPerSec));
-        for (int i = 0; i < COORDS; ++i) {
-            motor_[i]->speed(mSpeed[i]);
+        const auto mSpeed = convSpeed(speed);
+        const auto mGoal = convPos(goal);
+        for (int i = 0; i < N; ++i) {
+            motor_[i].speed(static_cast<uint16_t>(clamp(mSpeed[i], 0, Ms::maxSpeed[i])));
+            goalPos_[i] = static_cast<int16_t>(clamp(mGoal[i], 0, Ms::maxPos[i]));
         }
-        goalPos_ = clampEach(convPos(goal), 0u, MotorsConst::maxPos);
         sendMoveToGoal();
+        started();
+    }
+
+    // Goals with their speeds for the axes given, in one sync write of the adjacent goal position
+    // and moving speed registers. Speed is at least 1, as 0 is the top speed of the servo.
+    void track(const FVec<N>& goal, const FVec<N>& speed)
+    {
+        static_assert(Ms::regSpeed == Ms::regGoalPos + 2, "goal and speed should be adjacent");
+        uint8_t ids[N];
+        uint8_t data[N][4];
+        uint8_t n = 0;
+        for (int i = 0; i < N; ++i) {
+            if (!goal.has(i)) {
+                continue;
+            }
+            const auto g = lroundf(clamp(goal[i] / Ms::unitDeg[i], 0.f, Ms::maxPos[i] * 1.f));
+            const auto v =
+                    lroundf(clamp(speed[i] / Ms::unitDegPerMin[i], 1.f, Ms::maxSpeed[i] * 1.f));
+            goalPos_[i] = static_cast<int16_t>(g);
+            ids[n] = motorId(i);
+            data[n][0] = static_cast<uint8_t>(g);
+            data[n][1] = static_cast<uint8_t>(g >> 8);
+            data[n][2] = static_cast<uint8_t>(v);
+            data[n][3] = static_cast<uint8_t>(v >> 8);
+            goalSet_ |= 1u << i;
+            ++n;
+        }
+        s_ = DYN_STATUS_OK;
+        if (n > 0) {
+            s_ = di_->syncWrite(n, ids, Ms::regGoalPos, 4, data[0]);
+            started();
+        }
     }
 
     void stop()
@@ -283,7 +226,10 @@ public:
 		return isMoving_; 
 	}
 
-    FVec currentPos() { return convPos(motorCurrentPos()); }
+    FVec<N> currentPos() { return convPos(motorCurrentPos()); }
+
+    // Position read by the last loop.
+    FVec<N> cachedPos() { return convPos(currPos_); }
 
     void changeId(DynamixelID id, DynamixelID newId)
     {
@@ -301,7 +247,7 @@ public:
     void led(bool on = false, DynamixelID id = BROADCAST_ID)
     {
         const auto bon = static_cast<uint8_t>(on);
-        s_ = di_->write(id, 0X19, bon);
+        s_ = di_->write(id, Ms::regLed, bon);
     }
 
     void changeBaud(bool fast = false, DynamixelID id = BROADCAST_ID)
@@ -324,12 +270,38 @@ public:
     }
 
 private:
+    template <int... Is>
+    Motors(DynamixelInterface* di, reg::Seq<Is...>) : di_(di), motor_{{*di, motorId(Is)}...}
+    {
+    }
+
     void sendMoveToGoal()
     {
-        for (int i = 0; i < COORDS; ++i) {
-            motor_[i]->goalPosition(static_cast<uint16_t>(goalPos_[i]));
+        for (int i = 0; i < N; ++i) {
+            motor_[i].goalPosition(static_cast<uint16_t>(goalPos_[i]));
         }
         s_ = motorCurrentStatus();
+        goalSet_ = (1u << N) - 1;
+    }
+
+    // Moving from the command on, not from the next state read.
+    void started()
+    {
+        isMoving_ = true;
+        settledReads_ = 0;
+    }
+
+    // Arrival thresholds in servo units, tolerance off is any position.
+    void arrival(const Set<N>& s)
+    {
+        for (int i = 0; i < N; ++i) {
+            arriveTol_[i] = s.arriveTol_ > 0
+                    ? static_cast<int16_t>(max(1l, lroundf(s.arriveTol_ / Ms::unitDeg[i])))
+                    : INT16_MAX;
+            arriveSpeed_[i] = static_cast<int16_t>(
+                    lroundf(clamp(s.arriveSpeed_ / Ms::unitDegPerMin[i], 0.f, 32767.f)));
+        }
+        arriveReads_ = static_cast<uint8_t>(s.arriveReads_);
     }
 
     inline GStr statusMsg(DynamixelStatus s)
@@ -375,179 +347,470 @@ private:
         return F("unknown error");
     }
 
-    FVec convSpeed(const MVec& speed) { return speed.cast<float>() * MotorsConst::unitDegPerMin; }
+    // Conversions with per-axis units, a constant factor per axis when all models are the same.
+    static FVec<N> convPos(const MVec& pos)
+    {
+        FVec<N> v{};
+        for (int i = 0; i < N; ++i) {
+            v[i] = pos[i] * Ms::unitDeg[i];
+        }
+        return v;
+    }
 
-    FVec convPos(const MVec& pos) { return pos.cast<float>() * MotorsConst::unitDeg; }
+    // Speeds are clamped to the model range, so they fit into int32_t before clamping to the
+    // register range.
+    static Vec<int32_t, N> convSpeed(const FVec<N>& speed)
+    {
+        Vec<int32_t, N> v{};
+        for (int i = 0; i < N; ++i) {
+            v[i] = lroundf(clamp(speed[i] / Ms::unitDegPerMin[i], 0.f, 65535.f));
+        }
+        return v;
+    }
 
-    MVec convSpeed(const FVec& speed)
+    static Vec<int32_t, N> convPos(const FVec<N>& pos)
     {
-        return (speed * MotorsConst::unitDegPerMinInv).round<int16_t>();
+        Vec<int32_t, N> v{};
+        for (int i = 0; i < N; ++i) {
+            v[i] = lroundf(clamp(pos[i] / Ms::unitDeg[i], -65535.f, 65535.f));
+        }
+        return v;
     }
 
-    MVec convPos(const FVec& pos) { return (pos * MotorsConst::unitDegInv).round<int16_t>(); }
+    static uint32_t limits(int i)
+    {
+        return Ms::limitCw[i] | static_cast<uint32_t>(Ms::limitCcw[i]) << 16;
+    }
 
     MVec motorCurrentPos()
     {
         MVec pos{};
-        for (int i = 0; i < COORDS; ++i) {
-            pos[i] = motor_[i]->currentPosition();
+        for (int i = 0; i < N; ++i) {
+            pos[i] = motor_[i].currentPosition();
         }
         return pos;
     }
 
-	bool motorIsMoving() {		
-		s_ = DYN_STATUS_OK;
-		for (int i = 0; i < COORDS; ++i) {
-			uint8_t mmoving{};
-            s_ |= motor_[i]->read(0X2E, mmoving);
-			if(mmoving) {
-				return true;
-			}
-        }
-		return false;
-	}
-	
-    MVec motorCurrentSpeed()
+    // Present position, speed, load, voltage and temperature are adjacent in the control table,
+    // so one read per servo gives everything loop and telemetry need. The moving register is left
+    // out: motion ends when every servo is within the tolerance of its goal and slower than the
+    // threshold for the given number of reads in a row.
+    void readState()
     {
-        MVec speed{};
-        for (int i = 0; i < COORDS; ++i) {
-            uint16_t s{};
-            motor_[i]->read(0X26, s);
-            if (s >= 1024) {
-                speed[i] = -static_cast<int16_t>(s & ~1024);
+        s_ = DYN_STATUS_OK;
+        bool settled = true;
+        for (int i = 0; i < N; ++i) {
+            uint8_t r[presentLen]{};
+            const auto s = di_->read(motorId(i), Ms::regPresent, presentLen, r);
+            s_ |= s;
+            // A servo which did not answer is not known to have arrived.
+            if (s & DYN_STATUS_COM_ERROR) {
+                settled = false;
+                continue;
             }
-            else {
-                speed[i] = s;
+            auto& st = state_[i];
+            st.pos = static_cast<int16_t>(word(r, 0));
+            st.speed = signMagnitude(word(r, 2));
+            st.load = signMagnitude(word(r, 4));
+            st.voltage = r[6];
+            st.temp = r[7];
+            currPos_[i] = st.pos;
+            const bool near = !(goalSet_ >> i & 1) || abs(st.pos - goalPos_[i]) <= arriveTol_[i];
+            settled &= near && abs(st.speed) <= arriveSpeed_[i];
+        }
+        settledReads_ = settled ? static_cast<uint8_t>(min(settledReads_ + 1, 255)) : 0;
+        isMoving_ = settledReads_ < arriveReads_;
+    }
+
+    static DynamixelID motorId(int i) { return static_cast<DynamixelID>(i + 1); }
+
+    // Settings in servo units.
+    struct ServoSettings {
+        uint8_t acc;
+        uint8_t d;
+        uint8_t i;
+        uint8_t p;
+        uint16_t punch;
+        uint16_t torque;
+    };
+
+    void servoSettings(const Set<N>& s, ServoSettings* ss)
+    {
+        uint8_t mAcc[N]{};
+        for (int i = 0; i < N; ++i) {
+            if (Ms::hasAcc[i]) {
+                const float acc = s.accel_[i] / Ms::unitDegPerSec2[i];
+                mAcc[i] = static_cast<uint8_t>(lroundf(clamp(acc, 0.f, Ms::maxAcc[i] * 1.f)));
             }
         }
-        return speed;
+        const auto pGain = clampEach((s.p_ * 254.f).template round<uint8_t>(), 0u, 254u);
+        const auto iGain = clampEach((s.i_ * 254.f).template round<uint8_t>(), 0u, 254u);
+        const auto dGain = clampEach((s.d_ * 254.f).template round<uint8_t>(), 0u, 254u);
+        const auto punch = clampEach((s.punch_ * 1023.f).template round<uint16_t>(), 0u, 1023u);
+        const auto torque = clampEach((s.torque_ * 1023.f).template round<uint16_t>(), 0u, 1023u);
+        for (int i = 0; i < N; ++i) {
+            ss[i] = {mAcc[i], dGain[i], iGain[i], pGain[i], punch[i], torque[i]};
+        }
+    }
+
+    static uint16_t word(const uint8_t* r, int i)
+    {
+        return static_cast<uint16_t>(r[i] | (r[i + 1] << 8));
+    }
+
+    // Speed and load have direction in bit 10.
+    static int16_t signMagnitude(uint16_t v)
+    {
+        return v >= 1024 ? -static_cast<int16_t>(v & 1023) : static_cast<int16_t>(v);
     }
 
     DynamixelStatus motorCurrentStatus()
     {
-        for (auto m : motor_) {
-            if (auto s = m->status()) {
+        for (auto& m : motor_) {
+            if (auto s = m.status()) {
                 return s;
             }
         }
         return DYN_STATUS_OK;
     }
 
+    // Present position up to temperature.
+    static constexpr uint8_t presentLen = 8;
+
     DynamixelInterface* di_{};
-    DynamixelMotor* motor_[COORDS]{};
+    DynamixelMotor motor_[N];
+    ServoState state_[N]{};
+    unsigned long stateMs_{};
     MVec currPos_{};
     MVec goalPos_{};
     DynamixelStatus s_{DYN_STATUS_OK};
 	bool isMoving_{};
+    MVec arriveTol_{};
+    MVec arriveSpeed_{};
+    uint8_t arriveReads_{1};
+    uint8_t settledReads_{255};
+    // Axes whose goal was sent since their torque went off.
+    uint8_t goalSet_{};
 };
 
-class CallbacksImpl final : public Callbacks {
+// Time since reset at the end of each boot phase, shown by %4.
+class BootLog {
 public:
-    CallbacksImpl(Print* s, Motors* motors) : s_(s), motors_(motors) {}
+    enum Phase : uint8_t {
+        Baud,
+        Init,
+        Settings,
+        State,
+        count,
+    };
+
+    void mark(Phase p) { us_[p] = micros(); }
+
+    // Duration of each phase and the total, in microseconds.
+    void print(Print& p) const
+    {
+        p.print(F("[MSG:Boot us"));
+        unsigned long prev = 0;
+        for (uint8_t i = 0; i < count; ++i) {
+            p.print(' ');
+            p.print(name(static_cast<Phase>(i)));
+            p.print(':');
+            p.print(us_[i] - prev);
+            prev = us_[i];
+        }
+        p.print(F(" total:"));
+        p.print(prev);
+        p.print(F("]\n"));
+    }
+
+private:
+    static GStr name(Phase p)
+    {
+        switch (p) {
+        case Baud:
+            return F("baud");
+        case Init:
+            return F("init");
+        case Settings:
+            return F("settings");
+        default:
+            return F("state");
+        }
+    }
+
+    unsigned long us_[count]{};
+};
+
+template <int N, typename Ms = typename Same<Mx, N>::type>
+class CallbacksImpl final : public Callbacks<N> {
+public:
+    CallbacksImpl(Output* s, Motors<N, Ms>* motors) : s_(s), motors_(motors) {}
+
+    // Replies to commands go to the stream of the client being served, status pushes, the end of
+    // motion and telemetry to the push stream, the same one unless set.
+    void output(Output* s) { s_ = s; }
+
+    Output* output() const { return s_; }
+
+    // Replies still due to o are dropped, e.g. when its client leaves.
+    void forget(Output* o)
+    {
+        if (asked_ == o) {
+            asked_ = nullptr;
+        }
+        if (holder_ == o) {
+            holder_ = nullptr;
+            acksPending_ = 0;
+        }
+    }
+
+    void pushOutput(Output* p) { push_ = p; }
+
+    // Phases before begin(), e.g. baud rate change, are marked by the sketch.
+    BootLog& boot() { return boot_; }
+
+#if GSERVO_PROFILE
+    // Parse and drain sections are timed by the sketch.
+    Profiler& profiler() { return profiler_; }
+#endif
 
     void begin()
     {
         motors_->init();
+        boot_.mark(BootLog::Init);
         eol();
-        EEPROM.get(0, set_);
-        if (Reg{&set_}.anyNan()) {
-            set_ = defSettings();
+        if (SetStore<N>::load(set_) != SetStore<N>::Res::Ok) {
+            SetStore<N>::save(set_);
         }
-        motors_->updateSettings(set_);
+        ProfileStore<N>::load(static_cast<int>(set_.profile_), set_);
+        shutterPin();
+        motors_->updateSettings(set_, true);
+        boot_.mark(BootLog::Settings);
+        motors_->loop();
+        boot_.mark(BootLog::State);
+        lastReport_ = millis();
     }
 
+    // Task table shown by %7, e.g. the scheduler of the sketch.
+    void tasks(Tasks* t) { tasks_ = t; }
+
     void loop()
     {
-        bool wereMoving = motors_->isMoving();
-        motors_->loop();
+        control();
+        background();
+    }
+
+    // State read, end of motion and status reports, the part which has to keep its rate.
+    void control()
+    {
+        // Motion starts with the command, so the change is seen against the last tick.
+        const bool wereMoving = moving_;
+        if (pollDue()) {
+            GSERVO_PROFILE_SCOPE(profiler_, Bus);
+            refresh_ = false;
+            motors_->loop();
+            if (tracker_.active()) {
+                streamTrack();
+            }
+        }
+        GSERVO_PROFILE_SCOPE(profiler_, Report);
+        if (asked_) {
+            report(asked_);
+            asked_ = nullptr;
+            // Acks let go here belong to lines before this read, they need no read of their own.
+            release();
+            refresh_ = false;
+        }
+        moving_ = motors_->isMoving();
         if (wereMoving) {
-            if (!motors_->isMoving()) {
+            if (!moving_) {
                 stopped();
             }
         }
+        pushReport(wereMoving != moving_);
+    }
+
+    // Telemetry frames and the rest of long outputs, which may wait.
+    void background()
+    {
+        GSERVO_PROFILE_SCOPE(profiler_, Report);
+        pushTelemetry();
+        if (dumpFrom_ >= 0) {
+            dump();
+        }
+        if (hold_) {
+            hold();
+        }
+        if (scan_.active()) {
+            scanStep();
+        }
+        else if (run_ >= 0 && dumpFrom_ < 0 && !hold_ && !motors_->isMoving()) {
+            runLine();
+        }
+    }
+
+    // Output of the last command is still being produced, a dwell is not over, a program or a
+    // scan runs, a status report waits for the state read, next line should wait.
+    bool busy() const
+    {
+        return dumpFrom_ >= 0 || hold_ || run_ >= 0 || scan_.active() || asked_;
+    }
+
+    // Whether a line starting with c may be parsed now: ?, stop and tracking samples at any
+    // time, the rest once the motion ends, the output of the last command is produced and the
+    // dwell is over.
+    bool accepts(int c) const
+    {
+        return c == '?' || c == '!' || c == '@' || (!motors_->isMoving() && !busy());
     }
 
     void stopped()
     {
         if (report_) {
-            s_->print(F("[MSG:Pgm End]"));
+            UrgentScope u{push()};
+            push()->print(F("[MSG:Pgm End]"));
             report_ = false;
         }
     }
 
     void eol() override
     {
+        refresh_ = true;
+        // Program lines are quiet, an error ends the program and takes the place of its ack.
+        if (running_) {
+            if (anyError_) {
+                anyError_ = false;
+                s_->print(F("program "));
+                s_->print(static_cast<int>(run_));
+                s_->print(F(" line "));
+                s_->print(runLine_);
+                s_->print(F("\n"));
+                if (acksPending_ > 0) {
+                    --acksPending_;
+                }
+                running_ = false;
+                endRun();
+            }
+            return;
+        }
+        if (busy() && (!holder_ || holder_ == s_)) {
+            holder_ = s_;
+            // Saturates rather than wraps, a client sending that many lines unacked is lost anyway.
+            if (acksPending_ != 0xFFFF) {
+                ++acksPending_;
+            }
+            return;
+        }
+        ack();
+        // A line of another client let through while busy, e.g. stop, is acked at once and the
+        // work goes on in the output of the client it is for.
+        if (holder_) {
+            s_ = holder_;
+        }
+    }
+
+    void ack()
+    {
+        const bool bulk = bulk_;
+        bulk_ = false;
 		if(anyError_) { 
 			anyError_ = false;
 			s_->print(F("\n"));
 			return;			
 		}
+        // Ack follows the command output and the replies of earlier lines still queued, otherwise
+        // it goes ahead of the queued text.
+        if (!bulk && !s_->bulkQueued()) {
+            s_->prio(Output::Prio::Urgent);
+        }
         if (auto s = motors_->status()) {
             s_->print(F("Error: Motors "));
             s_->print(s);
             s_->print(F("\n"));
-			return;
-        } 
-		s_->print(F("ok\n"));				
+        }
+        else {
+            s_->print(F("ok\n"));
+        }
+        s_->prio(Output::Prio::Bulk);
     }
 
-    void homing() override { move(FVec::ofConst(set_.homingPullOff_), true); }
+    void homing() override { move(FVec<N>::ofConst(set_.homingPullOff_), true); }
 
     void setMode(Mode g) override { fast_ = g == Mode::Fast; }
 
     void setSpeed(float val) override { speedOverride_ = val; }
 
-    void move(const FVec& pos, bool report) override
+    void move(const FVec<N>& pos, bool report) override
     {
+        tracker_.stop();
         report_ = report;
-		unsigned invert = static_cast<unsigned>(set_.dirInvert_);		
         auto goal = motors_->currentPos();
-        for (int i = 0; i < COORDS; ++i) {
+        for (int i = 0; i < N; ++i) {
             if (pos.has(i)) {
-				goal[i] = pos[i] + set_.zero_[i];
-				if((1u << i) & invert) {
-					goal[i] = -goal[i];					
-				}
+                goal[i] = toMotor(i, pos[i]);
             }
         }
         auto speed = set_.speed_;
         if (!fast_ && speedOverride_ > 0) {
-            speed = FVec::ofConst(speedOverride_);
+            speed = FVec<N>::ofConst(speedOverride_);
         }
         motors_->move(goal, speed);
     }
 
+    // Samples go to the predictor, goals follow from the control tick.
+    void track(unsigned long ts, const FVec<N>& pos) override
+    {
+        report_ = false;
+        tracker_.add(ts, pos, millis(), set_.trackAlpha_, set_.trackBeta_);
+    }
+
+    // At rest the cached state may be $51 ms old, so the report waits for the read on the next
+    // tick and the ack of its line follows it. While moving or tracking the cache is fresh, so it
+    // is while busy for another client, whose acks the wait would hold up.
     void reportCurrentPos() override
     {
-		unsigned invert = static_cast<unsigned>(set_.dirInvert_);
-		auto mpos = motors_->currentPos();
-		for (int i = 0; i < COORDS; ++i) { 
-			if((1u << i) & invert) { 
-				mpos[i] = -mpos[i];
-			}
-		}
-        const auto pos = mpos - set_.zero_;		
-        s_->print(F("<Idle|MPos:"));
-        for (int i = 0; i < COORDS; ++i) {
-            s_->print(pos[i]);
-            s_->print(',');
+        if (motors_->isMoving() || tracker_.active() || (holder_ && holder_ != s_)) {
+            report(s_);
+            return;
+        }
+        asked_ = s_;
+        refresh_ = true;
+    }
+
+    void stop() override
+    {
+        tracker_.stop();
+        motors_->stop();
+        hold_ = false;
+        run_ = -1;
+        if (scan_.active()) {
+            scan_.stop();
+            shutter(false);
         }
-        s_->print(F("0.000|FS:0,0|Pn:YZ|WCO:20.000,0.000,0.000>\n"));
+        release();
     }
 
-    void stop() override { motors_->stop(); }
+    // Lines after it wait until the motion ends and then for ms, so does its ack.
+    void dwell(unsigned long ms) override
+    {
+        hold_ = true;
+        holdMs_ = ms;
+        holdFrom_ = millis();
+    }
 
 	void showSetting(unsigned s) override {
+		bulk_ = true;
 		if(s == 1) {
 			s_->print(motors_->isEnabled() ? 255 : 0);
 			s_->print(F("\n"));
 		} else { 
-			const auto val = Reg{&set_}.get(s);
+			const auto val = Reg<N>{&set_}.get(s);
 			if(isnan(val)) {				
 				s_->print(F("0\n"));
 			} else {
-				s_->print(val);
-				s_->print(F("\n"));
+				StrBuf<fixedMax + 1> line;
+				line.fixed(val).add('\n');
+				s_->write(line.data(), line.size());
 			}
 		}
 	}
@@ -557,28 +820,155 @@ public:
         if (s == 1) {
             motors_->enable(val == 255.f);
         }
-        else if (s > 250u && s < 250u + COORDS) {
+        else if (s >= 250u && s < 250u + N) {
             motors_->enable(hasVal && val > 0, s - 250);
         }
+        else if (s == 56 && hasVal && val > 0 && val < shutterPinMin) {
+            error(F("pin is in use"));
+        }
+        else if (s == 5) {
+            // Range is checked on a copy, a negative or NaN value never reaches the conversion.
+            auto probe = set_;
+            if (hasVal && Reg<N>{&probe}.set(s, val) != Reg<N>::Res::Ok) {
+                error(F("setting value out of range"));
+                return;
+            }
+            selectProfile(hasVal ? static_cast<unsigned>(val) : 0);
+        }
         else {
             const auto old = set_;
             if (!hasVal) {
-                auto ds = defSettings();
-                val = Reg{&ds}.get(s);
+                auto ds = defSettings<N>();
+                val = Reg<N>{&ds}.get(s);
             }
-            if(Reg{&set_}.set(s, val)) { 
-				motors_->updateSettings(set_);
-				if (memcmp(&old, &set_, sizeof(Set)) != 0) {
-					EEPROM.put(0, set_);
+            switch (Reg<N>{&set_}.set(s, val)) {
+            case Reg<N>::Res::Ok:
+				motors_->burstSettings(set_);
+				if (memcmp(&old, &set_, sizeof(set_)) != 0) {
+					SetStore<N>::save(set_);
+                    if (Reg<N>::isTuning(s)) {
+                        ProfileStore<N>::save(static_cast<int>(set_.profile_), set_);
+                    }
+                    if (s == 56) {
+                        shutterPin();
+                    }
 				}	
-			}            
+                break;
+            case Reg<N>::Res::Unknown:
+                error(F("unknown setting"));
+                break;
+            case Reg<N>::Res::OutOfRange:
+                error(F("setting value out of range"));
+                break;
+            }
+        }
+    }
+
+    bool beginProgram(unsigned k) override
+    {
+        if (k >= ProgramStore<N>::count) {
+            error(F("unknown program"));
+            return false;
+        }
+        rec_ = static_cast<int8_t>(k);
+        recLen_ = 0;
+        ProgramStore<N>::begin(rec_);
+        return true;
+    }
+
+    // Tokens go to EEPROM as they come, a program too long stays invalid.
+    void programLine(const uint8_t* tokens, int len) override
+    {
+        if (recLen_ < 0) {
+            return;
+        }
+        if (recLen_ + len > ProgramStore<N>::capacity) {
+            error(F("program too long"));
+            recLen_ = -1;
+            return;
+        }
+        for (int i = 0; i < len; ++i) {
+            ProgramStore<N>::write(rec_, recLen_++, tokens[i]);
+        }
+    }
+
+    void endProgram() override
+    {
+        if (recLen_ > 0) {
+            ProgramStore<N>::end(rec_, recLen_);
+        }
+        recLen_ = -1;
+    }
+
+    void callProgram(unsigned k, unsigned count, const float* params, int n) override
+    {
+        const int len = k < ProgramStore<N>::count ? ProgramStore<N>::length(k) : 0;
+        if (len == 0) {
+            error(F("unknown program"));
+            return;
+        }
+        run_ = static_cast<int8_t>(k);
+        runLen_ = static_cast<int16_t>(len);
+        runAt_ = 0;
+        runLine_ = 0;
+        runLoops_ = static_cast<uint16_t>(count);
+        for (int i = 0; i < prog::params; ++i) {
+            runParams_[i] = i < n ? params[i] : 0.f;
+        }
+    }
+
+    void listProgram(unsigned k) override
+    {
+        if (k >= ProgramStore<N>::count || ProgramStore<N>::length(k) == 0) {
+            error(F("unknown program"));
+            return;
+        }
+        list_ = static_cast<int8_t>(k);
+        startDump(Dump::Program);
+    }
+
+    // Moves, waits for the end of motion and $53, pulses the shutter for $54 and waits for $55
+    // from its start at each picture, all from background(). Ack comes after the last picture.
+    void scan(const FVec<N>& span, unsigned pattern) override
+    {
+        if (pattern > static_cast<unsigned>(Scan<N>::Pattern::Spiral)) {
+            error(F("unknown scan pattern"));
+            return;
+        }
+        tracker_.stop();
+        const auto p = static_cast<typename Scan<N>::Pattern>(pattern);
+        if (!scan_.start(axesPos(), span, set_.fov_, set_.scanOverlap_, p)) {
+            error(F("scan out of range"));
+            return;
+        }
+        scanPhase_ = ScanPhase::Move;
+    }
+
+    void selectProfile(unsigned k) override
+    {
+        if (k >= ProfileStore<N>::count) {
+            error(F("unknown profile"));
+            return;
+        }
+        // Active profile may have never been saved, keep it before leaving.
+        ProfileStore<N>::save(static_cast<int>(set_.profile_), set_);
+        if (!ProfileStore<N>::load(static_cast<int>(k), set_)) {
+            // New profile starts as a copy of the current one.
+            ProfileStore<N>::save(static_cast<int>(k), set_);
         }
+        set_.profile_ = static_cast<float>(k);
+        SetStore<N>::save(set_);
+        motors_->burstSettings(set_);
     }
 
-    void showSettings() override { Reg{&set_}.print(*s_); }
+    void showSettings() override
+    {
+        startDump(Dump::Settings);
+    }
 
     void error(GStr msg) override
     {
+        bulk_ = true;
         s_->print(msg);
         s_->print(F("; "));
 		anyError_ = true;
@@ -601,24 +991,59 @@ $H                       | homing to zero position
 g0 x%.2f y%.2f           | generic movement
 g1 x%.2f y%.2f f%.2f     | generic movement with given speed
 g0 x%.2f m2              | x axis only movement and report position after move
+g4 p%u                   | wait until the motion ends and then for ms, next lines wait as well
+m400                     | wait until the motion ends, ok comes then
+@ts x%.2f y%.2f          | tracking target at sender time ts, ms, goals are predicted from them
 x%.2f                    | x axis only movement
+scan x%.2f y%.2f p%u     | pictures over the span centred here, p0 rows, p1 spiral from the middle
+t1                       | select tuning profile 1, also as a word of movement: g0 x%.2f t1
+o1 sub                   | store next lines as program 1 up to o1 endsub, #1..#4 take values
+o1 call [10] [2.5] l3    | run program 1 three times with #1=10 and #2=2.5, ok comes at its end
+o1 list                  | show program 1
 ?                        | ask current position
 
 %0 id newId              | set servo id use id=254 to broadcast
 %1 id bool               | turn servo led to 1=on, 0=off
 %2 id                    | alarm shutdown
+%3                       | show count of output bytes dropped on a congested link
+%4                       | show duration of boot phases, us
+%5                       | show loop section timing, us, in builds with GSERVO_PROFILE=1
+%6                       | reset loop section timing
+%7                       | show scheduler tasks: runs, longest run us, over budget, late, deferred
+%8                       | reset scheduler task counters
+%9                       | show free RAM between heap and stack now and at the deepest stack
 %%                       | show help
 
 $$                       | show setting
 $1=255                   | set enable both axis then set to 255
 $3=0                     | direction invert mask, 1 - only x, 2 - only y, 3 - both
+$5=0                     | select tuning profile, speed, acceleration, gains, punch and torque
 $27=0                    | homing pull off, deg
+$40=0                    | push status report every ms while moving, zero is off
+$41=0                    | push status report every ms while idle, zero is off
+$42=0                    | send binary telemetry frame every ms, zero is off
+$43=30                   | tracking lead, ms, goals are predicted for now plus lead
+$44=0.5                  | tracking position gain, from 0 to 1
+$45=0.1                  | tracking velocity gain, from 0 to 2
+$46=200                  | tracking ends without samples for ms, zero is never
+$47=0.1                  | motion ends within deg of the goal, zero is anywhere
+$48=50                   | motion ends below speed deg/min
+$49=2                    | motion ends after reads in a row within $47 and $48
+$50=0                    | read servo state every ms while moving or tracking, zero is every tick
+$51=500                  | read servo state every ms at rest, zero is every tick
+$52=0.3                  | scan overlap of neighbour pictures, from 0 to 0.9
+$53=200                  | scan waits after the end of motion for ms before the shutter
+$54=100                  | shutter pulse, ms
+$55=500                  | scan moves on after ms from the shutter pulse
+$56=0                    | shutter pin from 4, zero is none
 $110=0                   | set speed deg/min x, zero is full speed
 $111=0                   | set speed deg/min y, zero is full speed
 $120=0                   | set acceleration deg/s^2 x, zero is full acceleration
 $121=0                   | set acceleration deg/s^2 y, zero is full acceleration
 $140=0                   | set zero position deg x
 $141=0                   | set zero position deg y
+$160=30                  | camera field of view deg x
+$161=30                  | camera field of view deg y
 $200=0.1                 | set proportional gain x, from 0 to 1
 $201=0.1                 | set proportional gain y, from 0 to 1
 $210=0                   | set integral gain x, from 0 to 1
@@ -632,12 +1057,53 @@ $241=1                   | set torque y, from 0 to 1
 $250=1                   | set enable x, 1 or 0
 $251=1                   | set enable y, 1 or 0
 )");
-        s_->print(msg);
+        bulk_ = true;
+        s_->pgm(msg);
     }
 
     void servoId(unsigned cmd, int id, int val) override
     {
+        if (cmd == 3) {
+            bulk_ = true;
+            s_->print(F("[MSG:Out dropped "));
+            s_->print(s_->dropped());
+            s_->print(F("]\n"));
+            return;
+        }
+        if (cmd == 4) {
+            bulk_ = true;
+            boot_.print(*s_);
+            return;
+        }
+#if GSERVO_PROFILE
+        if (cmd == 5) {
+            startDump(Dump::Profile);
+            return;
+        }
+        if (cmd == 6) {
+            profiler_.reset();
+            return;
+        }
+#endif
+        if (tasks_ && cmd == 7) {
+            startDump(Dump::Tasks);
+            return;
+        }
+        if (tasks_ && cmd == 8) {
+            tasks_->reset();
+            return;
+        }
+        if (cmd == 9) {
+            bulk_ = true;
+            s_->print(F("[MSG:Mem free:"));
+            s_->print(sram::freeStack());
+            s_->print(F(" low:"));
+            s_->print(sram::lowestFree());
+            s_->print(F("]\n"));
+            return;
+        }
         if (id < 0) {
+            bulk_ = true;
             s_->print(F("Should set servo id for "));
             s_->print(cmd);
             s_->print("\n");
@@ -655,6 +1121,7 @@ $251=1                   | set enable y, 1 or 0
             motors_->alarmShutdown(static_cast<DynamixelID>(id));            
             break;
         default:
+            bulk_ = true;
             s_->print(F("Wrong command "));
             s_->print(cmd);
             s_->print("\n");
@@ -663,13 +1130,355 @@ $251=1                   | set enable y, 1 or 0
     }
 
 private:
-    Print* s_;
-    Motors* motors_;
-    Set set_{};
+    // Fixed part and a position of up to 8 characters with separator per axis.
+    static constexpr size_t reportMax = 56 + N * 9;
+
+    // Position error of tracking is made up within this time, s.
+    static constexpr float trackCatchUp = 0.1f;
+
+    // Pins 0 and 1 are Serial, 2 and 3 the servo bus of the sketch.
+    static constexpr uint8_t shutterPinMin = 4;
+
+    Output* push() const { return push_ ? push_ : s_; }
+
+    // State is read every $50 ms while moving or tracking, every $51 ms at rest and on the tick
+    // after a command, whatever the rate of control().
+    bool pollDue() const
+    {
+        const bool fast = motors_->isMoving() || tracker_.active();
+        const auto period = static_cast<unsigned long>(fast ? set_.pollMoving_ : set_.pollIdle_);
+        return refresh_ || millis() - motors_->stateMs() >= period;
+    }
+
+    // Axis position in the servo frame.
+    float toMotor(int i, float pos) const
+    {
+        const float p = pos + set_.zero_[i];
+        return (1u << i) & static_cast<unsigned>(set_.dirInvert_) ? -p : p;
+    }
+
+    // Goal predicted for the time it takes effect, with the target velocity as speed plus what
+    // makes up the error. Tracking ends when samples stop coming.
+    void streamTrack()
+    {
+        const auto now = millis();
+        const auto timeout = static_cast<unsigned long>(set_.trackTimeout_);
+        if (timeout > 0 && now - tracker_.lastMs() > timeout) {
+            tracker_.stop();
+            UrgentScope u{push()};
+            push()->print(F("[MSG:Track lost]\n"));
+            return;
+        }
+        const auto target = tracker_.at(now + static_cast<unsigned long>(set_.trackLead_));
+        const auto& v = tracker_.velocity();
+        const auto curr = motors_->cachedPos();
+        auto goal = FVec<N>::ofNaN();
+        FVec<N> speed{};
+        for (int i = 0; i < N; ++i) {
+            if (!target.has(i)) {
+                continue;
+            }
+            goal[i] = toMotor(i, target[i]);
+            speed[i] = (fabsf(v[i]) + fabsf(goal[i] - curr[i]) / trackCatchUp) * 60.f;
+            if (set_.speed_[i] > 0) {
+                speed[i] = fminf(speed[i], set_.speed_[i]);
+            }
+        }
+        motors_->track(goal, speed);
+    }
+
+    // Axis positions from the state cached by the last loop, no bus access.
+    FVec<N> axesPos() const
+    {
+		unsigned invert = static_cast<unsigned>(set_.dirInvert_);
+		auto mpos = motors_->cachedPos();
+		for (int i = 0; i < N; ++i) { 
+			if((1u << i) & invert) { 
+				mpos[i] = -mpos[i];
+			}
+		}
+        return mpos - set_.zero_;
+    }
+
+    // Status report from the state cached by the last loop, no bus access.
+    void report(Output* o)
+    {
+        const auto pos = axesPos();
+        StrBuf<reportMax> r;
+        r.add(motors_->isMoving() ? F("<Run|MPos:") : F("<Idle|MPos:"));
+        r.fixed(pos).add(F(",0.000|FS:0,0|Pn:YZ|WCO:20.000,0.000,0.000>\n"));
+        // Whole report or nothing, congested link drops and counts it.
+        UrgentScope u{o};
+        o->write(r.data(), r.size());
+        lastReport_ = millis();
+    }
+
+    void pushReport(bool stateChanged)
+    {
+        const float interval = motors_->isMoving() ? set_.reportMoving_ : set_.reportIdle_;
+        if (stateChanged && (set_.reportMoving_ > 0 || set_.reportIdle_ > 0)) {
+            report(push());
+        }
+        else if (interval > 0 && millis() - lastReport_ >= static_cast<unsigned long>(interval)) {
+            report(push());
+        }
+    }
+
+    // Long outputs go in pieces, as much as the output queue takes now.
+    enum class Dump : uint8_t {
+        Settings,
+        Profile,
+        Tasks,
+        Program,
+    };
+
+    void startDump(Dump d)
+    {
+        bulk_ = true;
+        dump_ = d;
+        dumpFrom_ = 0;
+        dump();
+    }
+
+    void dump()
+    {
+        switch (dump_) {
+#if GSERVO_PROFILE
+        case Dump::Profile:
+            dumpFrom_ = profiler_.print(*s_, dumpFrom_, s_->room());
+            break;
+#endif
+        case Dump::Tasks:
+            dumpFrom_ = tasks_->print(*s_, dumpFrom_, s_->room());
+            break;
+        case Dump::Program:
+            dumpFrom_ = printProgram(dumpFrom_);
+            break;
+        default:
+            dumpFrom_ = Reg<N>{&set_}.print(*s_, dumpFrom_, s_->room());
+            break;
+        }
+        release();
+    }
+
+    // Lines of program list_ from token from as fit the output, returns where to go on or -1.
+    int printProgram(int from)
+    {
+        const int k = list_;
+        const int len = ProgramStore<N>::length(k);
+        const auto byte = [k](int i) { return ProgramStore<N>::byte(k, i); };
+        StrBuf<prog::textMax> line;
+        while (from < len) {
+            line.clear();
+            const int next = prog::detokenize(byte, from, len, nullptr, line);
+            if (line.size() > s_->room()) {
+                return from;
+            }
+            s_->write(line.data(), line.size());
+            from = next;
+        }
+        return -1;
+    }
+
+    // Next line of the running program, through the same parser and callbacks as the link.
+    void runLine()
+    {
+        if (runAt_ >= runLen_) {
+            if (--runLoops_ == 0) {
+                endRun();
+                return;
+            }
+            runAt_ = 0;
+            runLine_ = 0;
+        }
+        const int k = run_;
+        const auto byte = [k](int i) { return ProgramStore<N>::byte(k, i); };
+        StrBuf<prog::textMax> line;
+        runAt_ = static_cast<int16_t>(prog::detokenize(byte, runAt_, runLen_, runParams_, line));
+        ++runLine_;
+        running_ = true;
+        if (line.overflow()) {
+            error(F("program line too long"));
+            eol();
+        }
+        else {
+            Parser<N>{this}.parse(line.c_str(), static_cast<int>(line.size()));
+        }
+        running_ = false;
+    }
+
+    enum class ScanPhase : uint8_t {
+        Move,
+        Settle,
+        Shutter,
+        Expose,
+    };
+
+    // Settle time counts from the end of the motion, exposure from the shutter pulse.
+    void scanStep()
+    {
+        const auto now = millis();
+        const auto elapsed = now - scanFrom_;
+        switch (scanPhase_) {
+        case ScanPhase::Move: {
+            FVec<N> pos;
+            if (!scan_.next(pos)) {
+                scan_.stop();
+                release();
+                return;
+            }
+            move(pos, false);
+            scanFrom_ = now;
+            scanPhase_ = ScanPhase::Settle;
+            break;
+        }
+        case ScanPhase::Settle:
+            if (motors_->isMoving()) {
+                scanFrom_ = now;
+            }
+            else if (elapsed >= static_cast<unsigned long>(set_.scanSettle_)) {
+                shutter(true);
+                scanFrom_ = now;
+                scanPhase_ = ScanPhase::Shutter;
+            }
+            break;
+        case ScanPhase::Shutter:
+            if (elapsed >= static_cast<unsigned long>(set_.shutterPulse_)) {
+                shutter(false);
+                scanPhase_ = ScanPhase::Expose;
+            }
+            break;
+        case ScanPhase::Expose:
+            if (elapsed >= static_cast<unsigned long>(set_.scanExpose_)) {
+                UrgentScope u{push()};
+                push()->print(F("[MSG:Scan "));
+                push()->print(scan_.done());
+                push()->print('/');
+                push()->print(scan_.total());
+                push()->print(F("]\n"));
+                scanPhase_ = ScanPhase::Move;
+            }
+            break;
+        }
+    }
+
+    void shutter(bool on)
+    {
+        const auto pin = static_cast<uint8_t>(set_.shutterPin_);
+        if (pin >= shutterPinMin) {
+            digitalWrite(pin, on ? HIGH : LOW);
+        }
+    }
+
+    // Shutter closed from the moment the pin is set, not from the first picture. A pin in use,
+    // e.g. stored by an older build, is left alone as none.
+    void shutterPin()
+    {
+        const auto pin = static_cast<uint8_t>(set_.shutterPin_);
+        if (pin >= shutterPinMin) {
+            digitalWrite(pin, LOW);
+            pinMode(pin, OUTPUT);
+        }
+    }
+
+    // The ack of the call goes with the acks held since.
+    void endRun()
+    {
+        run_ = -1;
+        release();
+    }
+
+    // Dwell time counts from the end of the motion.
+    void hold()
+    {
+        const auto now = millis();
+        if (motors_->isMoving()) {
+            holdFrom_ = now;
+        }
+        else if (now - holdFrom_ >= holdMs_) {
+            hold_ = false;
+            release();
+        }
+    }
+
+    // Acks held back while busy, in order, once nothing holds them. They go to the client whose
+    // lines they are, whoever was served last.
+    void release()
+    {
+        if (!holder_) {
+            return;
+        }
+        Output* const s = s_;
+        s_ = holder_;
+        while (acksPending_ > 0 && !busy()) {
+            --acksPending_;
+            eol();
+        }
+        if (acksPending_ == 0) {
+            holder_ = nullptr;
+        }
+        s_ = s;
+    }
+
+    void pushTelemetry()
+    {
+        const auto now = millis();
+        const auto period = static_cast<unsigned long>(set_.telemetry_);
+        if (!(set_.telemetry_ > 0) || now - lastTelemetry_ < period) {
+            return;
+        }
+        lastTelemetry_ = now;
+        uint8_t frame[Telemetry<N>::frameMax];
+        const auto len = telemetry_.encode(frame, motors_->stateMs(), motors_->state());
+        UrgentScope u{push()};
+        if (push()->write(frame, len) != len) {
+            telemetry_.lost();
+        }
+    }
+
+    Output* s_;
+    Output* push_{};
+    Motors<N, Ms>* motors_;
+    Set<N> set_{};
     bool report_{};
+    bool moving_{};
+    bool refresh_{};
     float speedOverride_{};
     bool fast_{};
 	bool anyError_{};
+    bool bulk_{};
+    uint16_t acksPending_{};
+    // Output whose lines made it busy, the held acks are its.
+    Output* holder_{};
+    // Output waiting for a status report after the next state read.
+    Output* asked_{};
+    bool hold_{};
+    unsigned long holdMs_{};
+    unsigned long holdFrom_{};
+    Dump dump_{};
+    int dumpFrom_{-1};
+    float runParams_[prog::params]{};
+    int16_t runAt_{};
+    int16_t runLen_{};
+    uint16_t runLoops_{};
+    int16_t recLen_{-1};
+    int8_t run_{-1};
+    int8_t rec_{};
+    int8_t list_{};
+    uint8_t runLine_{};
+    bool running_{};
+    Scan<N> scan_;
+    ScanPhase scanPhase_{};
+    unsigned long scanFrom_{};
+    unsigned long lastReport_{};
+    Telemetry<N> telemetry_;
+    unsigned long lastTelemetry_{};
+    Tracker<N> tracker_;
+    BootLog boot_;
+#if GSERVO_PROFILE
+    Profiler profiler_;
+#endif
+    Tasks* tasks_{};
 };
 
 } // namespace gservo
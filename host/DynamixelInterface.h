@@ -0,0 +1,189 @@
+#pragma once
+
+// Host build stand-in for the ardyno DynamixelInterface: Protocol 1.0 packets are built and
+// checked here, the bytes go through transfer() of a concrete bus, e.g. the simulator.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t DynamixelID;
+typedef uint8_t DynamixelStatus;
+typedef uint8_t DynamixelInstruction;
+
+enum DynamixelStatusBits : uint8_t {
+    DYN_STATUS_OK = 0,
+    DYN_STATUS_INPUT_VOLTAGE_ERROR = 1,
+    DYN_STATUS_ANGLE_LIMIT_ERROR = 2,
+    DYN_STATUS_OVERHEATING_ERROR = 4,
+    DYN_STATUS_RANGE_ERROR = 8,
+    DYN_STATUS_CHECKSUM_ERROR = 16,
+    DYN_STATUS_OVERLOAD_ERROR = 32,
+    DYN_STATUS_INSTRUCTION_ERROR = 64,
+    // Errors of the exchange itself, with the com error bit set.
+    DYN_STATUS_COM_ERROR = 128,
+    DYN_STATUS_TIMEOUT = 1,
+    DYN_STATUS_INTERNAL_ERROR = 255,
+};
+
+enum : uint8_t {
+    BROADCAST_ID = 0xFE,
+};
+
+enum DynamixelInstructionCodes : uint8_t {
+    DYN_PING = 0x01,
+    DYN_READ = 0x02,
+    DYN_WRITE = 0x03,
+    DYN_REG_WRITE = 0x04,
+    DYN_ACTION = 0x05,
+    DYN_RESET = 0x06,
+    DYN_SYNC_WRITE = 0x83,
+    DYN_BULK_READ = 0x92,
+};
+
+enum DynamixelAddress : uint8_t {
+    DYN_ADDRESS_ID = 0x03,
+    DYN_ADDRESS_BAUDRATE = 0x04,
+    DYN_ADDRESS_RDT = 0x05,
+    DYN_ADDRESS_CW_LIMIT = 0x06,
+    DYN_ADDRESS_CCW_LIMIT = 0x08,
+    DYN_ADDRESS_SRL = 0x10,
+    DYN_ADDRESS_ENABLE_TORQUE = 0x18,
+    DYN_ADDRESS_LED = 0x19,
+    DYN_ADDRESS_GOAL_POSITION = 0x1E,
+    DYN_ADDRESS_GOAL_SPEED = 0x20,
+    DYN_ADDRESS_TORQUE_LIMIT = 0x22,
+    DYN_ADDRESS_CURRENT_POSITION = 0x24,
+};
+
+namespace dyn {
+
+// FF FF id length instruction-or-error params checksum, length counts params and two more.
+constexpr size_t headerLen = 5;
+constexpr size_t overhead = headerLen + 1;
+constexpr size_t packetMax = 160;
+
+inline uint8_t checksum(const uint8_t* packet, size_t len)
+{
+    uint8_t sum = 0;
+    for (size_t i = 2; i < len - 1; ++i) {
+        sum = static_cast<uint8_t>(sum + packet[i]);
+    }
+    return static_cast<uint8_t>(~sum);
+}
+
+// Builds the packet into buf, returns its length.
+inline size_t packet(uint8_t* buf, uint8_t id, uint8_t code, const uint8_t* params, size_t n)
+{
+    buf[0] = 0xFF;
+    buf[1] = 0xFF;
+    buf[2] = id;
+    buf[3] = static_cast<uint8_t>(n + 2);
+    buf[4] = code;
+    if (n) {
+        memcpy(buf + headerLen, params, n);
+    }
+    const size_t len = n + overhead;
+    buf[len - 1] = checksum(buf, len);
+    return len;
+}
+
+} // namespace dyn
+
+class DynamixelInterface {
+public:
+    virtual ~DynamixelInterface() = default;
+
+    // Timeout is for the whole status packet, ms.
+    virtual void begin(unsigned long baud, unsigned long timeout = 50) = 0;
+
+    // Sends the instruction packet and reads at most rxLen bytes of replies, returns the number
+    // of bytes read. Returns short when a reply does not come in time.
+    virtual size_t transfer(const uint8_t* tx, size_t txLen, uint8_t* rx, size_t rxLen) = 0;
+
+    DynamixelStatus ping(DynamixelID id) { return transaction(id, DYN_PING, nullptr, 0, 2); }
+
+    DynamixelStatus read(DynamixelID id, uint8_t addr, uint8_t size, uint8_t* ptr,
+                         uint8_t statusReturnLevel = 2)
+    {
+        const uint8_t params[]{addr, size};
+        return transaction(id, DYN_READ, params, 2, statusReturnLevel, ptr, size);
+    }
+
+    DynamixelStatus write(DynamixelID id, uint8_t addr, uint8_t size, const uint8_t* ptr,
+                          uint8_t statusReturnLevel = 2)
+    {
+        uint8_t params[dyn::packetMax];
+        if (size + 1u + dyn::overhead > sizeof(params)) {
+            return DYN_STATUS_INTERNAL_ERROR;
+        }
+        params[0] = addr;
+        memcpy(params + 1, ptr, size);
+        return transaction(id, DYN_WRITE, params, size + 1u, statusReturnLevel);
+    }
+
+    // Data holds size bytes for each of the n servos, in the order of ids. Broadcast, no reply.
+    DynamixelStatus syncWrite(uint8_t n, const uint8_t* ids, uint8_t addr, uint8_t size,
+                              const uint8_t* data, uint8_t statusReturnLevel = 2)
+    {
+        uint8_t params[dyn::packetMax];
+        const size_t len = 2u + n * (size + 1u);
+        if (len + dyn::overhead > sizeof(params)) {
+            return DYN_STATUS_INTERNAL_ERROR;
+        }
+        params[0] = addr;
+        params[1] = size;
+        for (uint8_t i = 0; i < n; ++i) {
+            params[2 + i * (size + 1)] = ids[i];
+            memcpy(params + 3 + i * (size + 1), data + i * size, size);
+        }
+        return transaction(BROADCAST_ID, DYN_SYNC_WRITE, params, len, statusReturnLevel);
+    }
+
+    template <typename T>
+    DynamixelStatus read(DynamixelID id, uint8_t addr, T& data, uint8_t statusReturnLevel = 2)
+    {
+        return read(id, addr, sizeof(T), reinterpret_cast<uint8_t*>(&data), statusReturnLevel);
+    }
+
+    template <typename T>
+    DynamixelStatus write(DynamixelID id, uint8_t addr, const T& data,
+                          uint8_t statusReturnLevel = 2)
+    {
+        return write(id, addr, sizeof(T), reinterpret_cast<const uint8_t*>(&data),
+                     statusReturnLevel);
+    }
+
+private:
+    // Servo replies to ping always, to read with status return level 1 and to anything with 2,
+    // but never to broadcast.
+    DynamixelStatus transaction(DynamixelID id, uint8_t code, const uint8_t* params, size_t n,
+                                uint8_t statusReturnLevel, uint8_t* answer = nullptr,
+                                uint8_t answerLen = 0)
+    {
+        uint8_t tx[dyn::packetMax];
+        const auto txLen = dyn::packet(tx, id, code, params, n);
+        const bool reply = id != BROADCAST_ID
+                && (code == DYN_PING || statusReturnLevel == 2
+                    || (code == DYN_READ && statusReturnLevel == 1));
+        uint8_t rx[dyn::packetMax];
+        const size_t rxLen = reply ? answerLen + dyn::overhead : 0;
+        const auto got = transfer(tx, txLen, rx, rxLen);
+        if (!reply) {
+            return DYN_STATUS_OK;
+        }
+        if (got < rxLen) {
+            return DYN_STATUS_COM_ERROR | DYN_STATUS_TIMEOUT;
+        }
+        if (rx[0] != 0xFF || rx[1] != 0xFF || rx[2] != id || rx[3] != answerLen + 2) {
+            return DYN_STATUS_COM_ERROR;
+        }
+        if (rx[rxLen - 1] != dyn::checksum(rx, rxLen)) {
+            return DYN_STATUS_COM_ERROR | DYN_STATUS_CHECKSUM_ERROR;
+        }
+        if (answerLen) {
+            memcpy(answer, rx + dyn::headerLen, answerLen);
+        }
+        return rx[4];
+    }
+};
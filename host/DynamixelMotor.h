@@ -0,0 +1,82 @@
+#pragma once
+
+// Host build stand-in for the ardyno DynamixelMotor, the subset the firmware uses.
+
+#include "DynamixelInterface.h"
+
+class DynamixelDevice {
+public:
+    DynamixelDevice(DynamixelInterface& di, DynamixelID id) : di_(di), id_(id) {}
+
+    // Learns the status return level, servos set to 0 do not answer reads.
+    DynamixelStatus init()
+    {
+        srl_ = 2;
+        status_ = ping();
+        if (status_ != DYN_STATUS_OK) {
+            return status_;
+        }
+        if (read(DYN_ADDRESS_SRL, srl_) & DYN_STATUS_TIMEOUT) {
+            srl_ = 0;
+        }
+        status_ = DYN_STATUS_OK;
+        return status_;
+    }
+
+    DynamixelStatus ping() { return status_ = di_.ping(id_); }
+
+    DynamixelStatus status() const { return status_; }
+
+    DynamixelID id() const { return id_; }
+
+    uint8_t statusReturnLevel() const { return srl_; }
+
+    template <typename T>
+    DynamixelStatus read(uint8_t addr, T& data)
+    {
+        return status_ = di_.read(id_, addr, data, srl_);
+    }
+
+    template <typename T>
+    DynamixelStatus write(uint8_t addr, const T& data)
+    {
+        return status_ = di_.write(id_, addr, data, srl_);
+    }
+
+private:
+    DynamixelInterface& di_;
+    DynamixelID id_;
+    uint8_t srl_{2};
+    DynamixelStatus status_{DYN_STATUS_OK};
+};
+
+class DynamixelMotor : public DynamixelDevice {
+public:
+    DynamixelMotor(DynamixelInterface& di, DynamixelID id) : DynamixelDevice(di, id) {}
+
+    void wheelMode() { jointMode(0, 0); }
+
+    void jointMode(uint16_t cwLimit = 0, uint16_t ccwLimit = 0x3FF)
+    {
+        const uint32_t limits = cwLimit | static_cast<uint32_t>(ccwLimit) << 16;
+        write(DYN_ADDRESS_CW_LIMIT, limits);
+    }
+
+    void enableTorque(bool on = true)
+    {
+        write(DYN_ADDRESS_ENABLE_TORQUE, static_cast<uint8_t>(on));
+    }
+
+    void speed(uint16_t speed) { write(DYN_ADDRESS_GOAL_SPEED, speed); }
+
+    void goalPosition(uint16_t pos) { write(DYN_ADDRESS_GOAL_POSITION, pos); }
+
+    void led(uint8_t on) { write(DYN_ADDRESS_LED, on); }
+
+    uint16_t currentPosition()
+    {
+        uint16_t pos{};
+        read(DYN_ADDRESS_CURRENT_POSITION, pos);
+        return pos;
+    }
+};
@@ -0,0 +1,433 @@
+#pragma once
+
+// Simulated Dynamixel bus for host builds: Protocol 1.0 MX servos with the whole control table,
+// first order motion towards the goal and the wire time of every byte at the bus baud rate, so
+// the firmware runs unchanged on a PC and its bus timing can be measured.
+
+#include "DynamixelInterface.h"
+#include "Print.h"
+
+#include <math.h>
+
+#include <functional>
+#include <vector>
+
+namespace host {
+
+// MX-12W with Protocol 1.0 firmware.
+class SimServo {
+public:
+    static constexpr uint8_t tableLen = 0x4A;
+
+    // Units of the control table.
+    static constexpr float posPerDeg = 1.f / 0.088f;
+    static constexpr float degPerSecPerSpeed = 0.916f * 6.f;
+    static constexpr float degPerSec2PerAcc = 8.583f;
+
+    enum : uint8_t {
+        regModel = 0x00,
+        regVersion = 0x02,
+        regTempLimit = 0x0B,
+        regVoltageMin = 0x0C,
+        regVoltageMax = 0x0D,
+        regTorqueMax = 0x0E,
+        regAlarmLed = 0x11,
+        regAlarmShutdown = 0x12,
+        regGains = 0x1A,
+        regPresentSpeed = 0x26,
+        regPresentLoad = 0x28,
+        regVoltage = 0x2A,
+        regTemp = 0x2B,
+        regRegistered = 0x2C,
+        regMoving = 0x2E,
+        regLock = 0x2F,
+        regPunch = 0x30,
+        regAcc = 0x49,
+    };
+
+    explicit SimServo(uint8_t id) { reset(id); }
+
+    // Factory defaults, except the id.
+    void reset(uint8_t id)
+    {
+        memset(table_, 0, sizeof(table_));
+        set16(regModel, 360);
+        table_[regVersion] = 36;
+        table_[DYN_ADDRESS_ID] = id;
+        table_[DYN_ADDRESS_BAUDRATE] = 1;
+        table_[DYN_ADDRESS_RDT] = 250;
+        set16(DYN_ADDRESS_CCW_LIMIT, 0xFFF);
+        table_[regTempLimit] = 70;
+        table_[regVoltageMin] = 60;
+        table_[regVoltageMax] = 160;
+        set16(regTorqueMax, 0x3FF);
+        table_[DYN_ADDRESS_SRL] = 2;
+        table_[regAlarmLed] = 36;
+        table_[regAlarmShutdown] = 36;
+        table_[regGains + 2] = 32;
+        set16(DYN_ADDRESS_TORQUE_LIMIT, 0x3FF);
+        table_[regVoltage] = 120;
+        table_[regTemp] = 36;
+        table_[regPunch] = 32;
+        set16(DYN_ADDRESS_GOAL_POSITION, static_cast<uint16_t>(lroundf(pos_)));
+        vel_ = 0;
+        updatePresent(0);
+    }
+
+    uint8_t id() const { return table_[DYN_ADDRESS_ID]; }
+
+    // Bus speed the servo listens at, bit/s.
+    unsigned long baud() const
+    {
+        const uint8_t b = table_[DYN_ADDRESS_BAUDRATE];
+        return b >= 250 ? 2250000ul + (b - 250) * 250000ul : 2000000ul / (b + 1ul);
+    }
+
+    // Delay before the status packet, us.
+    unsigned long returnDelay() const { return table_[DYN_ADDRESS_RDT] * 2ul; }
+
+    uint8_t statusReturnLevel() const { return table_[DYN_ADDRESS_SRL]; }
+
+    uint8_t reg(uint8_t addr) const { return table_[addr]; }
+
+    uint16_t reg16(uint8_t addr) const
+    {
+        return static_cast<uint16_t>(table_[addr] | table_[addr + 1] << 8);
+    }
+
+    float position() const { return pos_; }
+
+    void setPosition(float pos) { pos_ = pos; }
+
+    // Time constant of the approach to the goal, s.
+    void setLag(float tau) { tau_ = tau; }
+
+    // Reads into out, returns the error bits of the status packet.
+    uint8_t read(uint8_t addr, uint8_t len, uint8_t* out) const
+    {
+        if (addr + len > tableLen) {
+            memset(out, 0, len);
+            return DYN_STATUS_RANGE_ERROR;
+        }
+        memcpy(out, table_ + addr, len);
+        return error_;
+    }
+
+    // Writes to read only registers are ignored, goal outside of the joint mode limits is
+    // refused with the angle limit error.
+    uint8_t write(uint8_t addr, uint8_t len, const uint8_t* data)
+    {
+        if (addr + len > tableLen) {
+            return DYN_STATUS_RANGE_ERROR;
+        }
+        uint8_t t[tableLen];
+        memcpy(t, table_, sizeof(t));
+        memcpy(t + addr, data, len);
+        const auto goal = static_cast<uint16_t>(t[DYN_ADDRESS_GOAL_POSITION]
+                                                | t[DYN_ADDRESS_GOAL_POSITION + 1] << 8);
+        error_ = 0;
+        if (!multiTurn(t) && (goal < word(t, DYN_ADDRESS_CW_LIMIT)
+                              || goal > word(t, DYN_ADDRESS_CCW_LIMIT))) {
+            error_ = DYN_STATUS_ANGLE_LIMIT_ERROR;
+            memcpy(t + DYN_ADDRESS_GOAL_POSITION, table_ + DYN_ADDRESS_GOAL_POSITION, 2);
+        }
+        for (uint8_t a = addr; a < addr + len; ++a) {
+            if (writable(a)) {
+                table_[a] = t[a];
+            }
+        }
+        // Goal position turns the torque on.
+        if (!error_ && addr <= DYN_ADDRESS_GOAL_POSITION + 1
+            && addr + len > DYN_ADDRESS_GOAL_POSITION) {
+            table_[DYN_ADDRESS_ENABLE_TORQUE] = 1;
+        }
+        return error_;
+    }
+
+    // Moves the servo from its last time to now, us. Velocity is first order towards the goal
+    // within the moving speed and the goal acceleration, in steps of at most 1 ms.
+    void advance(unsigned long now)
+    {
+        while (time_ < now) {
+            const unsigned long step = min(now - time_, 1000ul);
+            time_ += step;
+            move(step * 1e-6f);
+        }
+    }
+
+private:
+    static uint16_t word(const uint8_t* t, uint8_t addr)
+    {
+        return static_cast<uint16_t>(t[addr] | t[addr + 1] << 8);
+    }
+
+    static bool multiTurn(const uint8_t* t)
+    {
+        return word(t, DYN_ADDRESS_CW_LIMIT) == 0xFFF && word(t, DYN_ADDRESS_CCW_LIMIT) == 0xFFF;
+    }
+
+    static bool writable(uint8_t addr)
+    {
+        return addr >= DYN_ADDRESS_ID
+                && !(addr >= DYN_ADDRESS_CURRENT_POSITION && addr < regLock);
+    }
+
+    void set16(uint8_t addr, uint16_t v)
+    {
+        table_[addr] = static_cast<uint8_t>(v);
+        table_[addr + 1] = static_cast<uint8_t>(v >> 8);
+    }
+
+    void move(float dt)
+    {
+        const auto acc = table_[regAcc];
+        const float maxAcc = acc ? acc * degPerSec2PerAcc * posPerDeg : INFINITY;
+        float target = 0;
+        if (table_[DYN_ADDRESS_ENABLE_TORQUE]) {
+            // Zero is the top speed of the motor. Speed also allows to stop at the goal.
+            const uint16_t speed = reg16(DYN_ADDRESS_GOAL_SPEED) & 0x3FF;
+            const uint16_t limit = speed && speed < noLoadSpeed ? speed : uint16_t{noLoadSpeed};
+            const float err = reg16(DYN_ADDRESS_GOAL_POSITION) - pos_;
+            const float top = fminf(limit * posPerSpeed(), sqrtf(2 * maxAcc * fabsf(err)));
+            target = fmaxf(-top, fminf(top, err / tau_));
+        }
+        const float dv = maxAcc * dt;
+        const float change = fmaxf(-dv, fminf(dv, target - vel_));
+        vel_ += change;
+        pos_ += vel_ * dt;
+        updatePresent(dt > 0 ? change / dt : 0);
+    }
+
+    // Load stands for the share of the torque spent on acceleration.
+    void updatePresent(float acc)
+    {
+        const auto pos = static_cast<long>(lroundf(pos_));
+        const auto present = pos < 0 ? 0 : min(pos, 0xFFFl);
+        set16(DYN_ADDRESS_CURRENT_POSITION, static_cast<uint16_t>(present));
+        set16(regPresentSpeed, signMagnitude(vel_ / posPerSpeed()));
+        const float fullAcc = noLoadSpeed * posPerSpeed() / 0.05f;
+        set16(regPresentLoad, signMagnitude(acc / fullAcc * reg16(DYN_ADDRESS_TORQUE_LIMIT)));
+        const float err = reg16(DYN_ADDRESS_GOAL_POSITION) - pos_;
+        table_[regMoving] = fabsf(err) > 0.5f || fabsf(vel_) > posPerSpeed() ? 1 : 0;
+    }
+
+    // Bit 10 is set for the clockwise direction.
+    static uint16_t signMagnitude(float v)
+    {
+        const auto m = static_cast<uint16_t>(min(lroundf(fabsf(v)), 1023l));
+        return v < 0 ? static_cast<uint16_t>(m | 0x400) : m;
+    }
+
+    static float posPerSpeed() { return degPerSecPerSpeed * posPerDeg; }
+
+    // 470 rpm without load.
+    enum : uint16_t { noLoadSpeed = 513 };
+
+    uint8_t table_[tableLen];
+    uint8_t error_{};
+    float pos_{2048};
+    float vel_{};
+    float tau_{0.02f};
+    unsigned long time_{Clock::us()};
+};
+
+// Servos on one half duplex line. Bytes take their wire time at the bus baud rate, a servo hears
+// packets only at its own baud rate and a missing reply costs the full timeout.
+class SimBus final : public DynamixelInterface {
+public:
+    // Servos with ids 1..n.
+    explicit SimBus(int n)
+    {
+        for (int i = 0; i < n; ++i) {
+            servos_.emplace_back(static_cast<uint8_t>(i + 1));
+        }
+    }
+
+    void begin(unsigned long baud, unsigned long timeout = 50) override
+    {
+        baud_ = baud;
+        timeoutUs_ = timeout * 1000;
+    }
+
+    size_t transfer(const uint8_t* tx, size_t txLen, uint8_t* rx, size_t rxLen) override
+    {
+        ++packets_;
+        wire(txLen);
+        for (auto& s : servos_) {
+            s.advance(Clock::us());
+        }
+        uint8_t reply[dyn::packetMax];
+        const size_t len = handle(tx, txLen, reply);
+        if (len == 0) {
+            if (rxLen) {
+                ++timeouts_;
+                Clock::advance(timeoutUs_);
+            }
+            return 0;
+        }
+        const size_t n = min(len, rxLen);
+        memcpy(rx, reply, n);
+        return n;
+    }
+
+    // Servo by id, null when there is no such servo.
+    SimServo* servo(uint8_t id)
+    {
+        for (auto& s : servos_) {
+            if (s.id() == id) {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+
+    // Called for every write a servo gets, when the whole instruction packet is on the wire.
+    void onWrite(std::function<void(uint8_t id, uint8_t addr, uint8_t len)> f)
+    {
+        onWrite_ = std::move(f);
+    }
+
+    unsigned long packets() const { return packets_; }
+
+    unsigned long bytes() const { return bytes_; }
+
+    unsigned long timeouts() const { return timeouts_; }
+
+private:
+    // Start bit, 8 data bits and stop bit per byte.
+    void wire(size_t n)
+    {
+        bytes_ += n;
+        Clock::advance(static_cast<unsigned long>(n * 10 * 1000000ull / baud_));
+    }
+
+    // Within the tolerance of a UART.
+    bool hears(const SimServo& s) const
+    {
+        const long d = static_cast<long>(s.baud()) - static_cast<long>(baud_);
+        return labs(d) * 100 <= static_cast<long>(baud_) * 3;
+    }
+
+    // Executes the instruction, returns the length of replies put into out.
+    size_t handle(const uint8_t* p, size_t len, uint8_t* out)
+    {
+        if (len < dyn::overhead || p[0] != 0xFF || p[1] != 0xFF || p[3] + 4u != len) {
+            return 0;
+        }
+        const uint8_t id = p[2];
+        const uint8_t code = p[4];
+        const uint8_t* params = p + dyn::headerLen;
+        const size_t n = len - dyn::overhead;
+        const bool broadcast = id == BROADCAST_ID;
+        const bool valid = p[len - 1] == dyn::checksum(p, len);
+        if (code == DYN_SYNC_WRITE && broadcast && valid) {
+            applySyncWrite(params, n);
+            return 0;
+        }
+        if (code == DYN_BULK_READ && broadcast && valid) {
+            return answerBulkRead(params, n, out);
+        }
+        size_t r = 0;
+        for (auto& s : servos_) {
+            if ((s.id() != id && !broadcast) || !hears(s)) {
+                continue;
+            }
+            uint8_t data[SimServo::tableLen]{};
+            uint8_t dataLen = 0;
+            const uint8_t error = valid ? execute(s, code, params, n, data, dataLen)
+                                        : static_cast<uint8_t>(DYN_STATUS_CHECKSUM_ERROR);
+            const bool reply = code == DYN_PING || s.statusReturnLevel() == 2
+                    || (code == DYN_READ && s.statusReturnLevel() == 1);
+            if (!broadcast && reply) {
+                r = status(s, error, data, dataLen, out);
+            }
+        }
+        return r;
+    }
+
+    uint8_t execute(SimServo& s, uint8_t code, const uint8_t* params, size_t n, uint8_t* data,
+                    uint8_t& dataLen)
+    {
+        switch (code) {
+        case DYN_PING:
+            return 0;
+        case DYN_READ:
+            if (n != 2) {
+                return DYN_STATUS_INSTRUCTION_ERROR;
+            }
+            dataLen = params[1];
+            return s.read(params[0], params[1], data);
+        case DYN_WRITE:
+            if (n < 2) {
+                return DYN_STATUS_INSTRUCTION_ERROR;
+            }
+            written(s, params[0], static_cast<uint8_t>(n - 1));
+            return s.write(params[0], static_cast<uint8_t>(n - 1), params + 1);
+        case DYN_RESET:
+            s.reset(1);
+            return 0;
+        default:
+            return DYN_STATUS_INSTRUCTION_ERROR;
+        }
+    }
+
+    // Address, size, then id and size bytes for each servo.
+    void applySyncWrite(const uint8_t* params, size_t n)
+    {
+        if (n < 2) {
+            return;
+        }
+        const uint8_t size = params[1];
+        for (size_t i = 2; i + size + 1 <= n; i += size + 1u) {
+            auto s = servo(params[i]);
+            if (s && hears(*s)) {
+                written(*s, params[0], size);
+                s->write(params[0], size, params + i + 1);
+            }
+        }
+    }
+
+    // Zero, then length, id and address for each servo, which answer one after another.
+    size_t answerBulkRead(const uint8_t* params, size_t n, uint8_t* out)
+    {
+        size_t r = 0;
+        for (size_t i = 1; i + 3 <= n; i += 3) {
+            auto s = servo(params[i + 1]);
+            uint8_t data[SimServo::tableLen]{};
+            const uint8_t len = params[i];
+            if (!s || !hears(*s) || len > sizeof(data)
+                || r + len + dyn::overhead > dyn::packetMax) {
+                break;
+            }
+            const uint8_t error = s->read(params[i + 2], len, data);
+            r += status(*s, error, data, len, out + r);
+        }
+        return r;
+    }
+
+    void written(const SimServo& s, uint8_t addr, uint8_t len)
+    {
+        if (onWrite_) {
+            onWrite_(s.id(), addr, len);
+        }
+    }
+
+    size_t status(const SimServo& s, uint8_t error, const uint8_t* data, uint8_t len,
+                  uint8_t* out)
+    {
+        Clock::advance(s.returnDelay());
+        const auto n = dyn::packet(out, s.id(), error, data, len);
+        wire(n);
+        return n;
+    }
+
+    std::vector<SimServo> servos_;
+    std::function<void(uint8_t, uint8_t, uint8_t)> onWrite_;
+    unsigned long baud_{1000000};
+    unsigned long timeoutUs_{50000};
+    unsigned long packets_{};
+    unsigned long bytes_{};
+    unsigned long timeouts_{};
+};
+
+} // namespace host
@@ -0,0 +1,52 @@
+#pragma once
+
+// Host build stand-in for the Arduino EEPROM library, cells of the ATmega328P in memory. As on
+// the AVR, EEPROM is a stateless accessor, so the cells are shared by every translation unit.
+
+#include <stdint.h>
+#include <string.h>
+
+#define E2END 1023
+
+namespace host {
+
+constexpr int eepromSize = E2END + 1;
+
+// Cells start erased.
+inline uint8_t* eeprom()
+{
+    static uint8_t cells[eepromSize];
+    static bool erased = (memset(cells, 0xFF, sizeof(cells)), true);
+    (void)erased;
+    return cells;
+}
+
+inline void eraseEeprom() { memset(eeprom(), 0xFF, eepromSize); }
+
+} // namespace host
+
+struct EEPROMClass {
+    uint8_t read(int i) { return host::eeprom()[i]; }
+
+    void write(int i, uint8_t v) { host::eeprom()[i] = v; }
+
+    void update(int i, uint8_t v) { write(i, v); }
+
+    template <typename T>
+    T& get(int i, T& t)
+    {
+        memcpy(&t, host::eeprom() + i, sizeof(T));
+        return t;
+    }
+
+    template <typename T>
+    const T& put(int i, const T& t)
+    {
+        memcpy(host::eeprom() + i, &t, sizeof(T));
+        return t;
+    }
+
+    uint16_t length() { return host::eepromSize; }
+};
+
+static EEPROMClass EEPROM;
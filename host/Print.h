@@ -0,0 +1,202 @@
+#pragma once
+
+// Host build stand-in for the Arduino core Print, with the time functions driven by a simulated
+// clock, so runs on a PC are deterministic and bus timing is the simulated one. The Linux daemon
+// switches the clock to real time.
+
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+namespace host {
+
+// Microseconds since start, moved forward by the servo bus simulator for the bytes on the wire
+// and by the code driving the main loop for everything else. In real time mode it is the
+// monotonic system clock from the switch and advancing it sleeps.
+class Clock {
+public:
+    static unsigned long us() { return real() ? system() - start() : now(); }
+
+    static void advance(unsigned long us)
+    {
+        if (!real()) {
+            now() += us;
+            return;
+        }
+        timespec ts{static_cast<time_t>(us / 1000000), static_cast<long>(us % 1000000 * 1000)};
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+        }
+    }
+
+    static void realTime(bool on)
+    {
+        real() = on;
+        start() = system();
+    }
+
+private:
+    static unsigned long& now()
+    {
+        static unsigned long t = 0;
+        return t;
+    }
+
+    static unsigned long& start()
+    {
+        static unsigned long t = 0;
+        return t;
+    }
+
+    static unsigned long system()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<unsigned long>(ts.tv_sec) * 1000000ul
+                + static_cast<unsigned long>(ts.tv_nsec / 1000);
+    }
+
+    static bool& real()
+    {
+        static bool r = false;
+        return r;
+    }
+};
+
+} // namespace host
+
+inline unsigned long micros() { return host::Clock::us(); }
+
+inline unsigned long millis() { return host::Clock::us() / 1000; }
+
+inline void delay(unsigned long ms) { host::Clock::advance(ms * 1000); }
+
+inline void delayMicroseconds(unsigned int us) { host::Clock::advance(us); }
+
+#ifndef HIGH
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#endif
+
+namespace host {
+
+// Digital outputs, levels written by the firmware and the count of rising edges per pin.
+class Pins {
+public:
+    static constexpr int count = 64;
+
+    static void mode(uint8_t pin, uint8_t m)
+    {
+        if (pin < count) {
+            outputTable()[pin] = m == OUTPUT;
+        }
+    }
+
+    static bool output(uint8_t pin) { return pin < count && outputTable()[pin]; }
+
+    static void write(uint8_t pin, uint8_t val)
+    {
+        if (pin >= count) {
+            return;
+        }
+        riseTable()[pin] += val && !levelTable()[pin];
+        levelTable()[pin] = val != 0;
+    }
+
+    static bool level(uint8_t pin) { return pin < count && levelTable()[pin]; }
+
+    static unsigned rises(uint8_t pin) { return pin < count ? riseTable()[pin] : 0; }
+
+    static void reset()
+    {
+        memset(outputTable(), 0, sizeof(bool) * count);
+        memset(levelTable(), 0, sizeof(bool) * count);
+        memset(riseTable(), 0, sizeof(unsigned) * count);
+    }
+
+private:
+    static bool* outputTable()
+    {
+        static bool o[count]{};
+        return o;
+    }
+
+    static bool* levelTable()
+    {
+        static bool l[count]{};
+        return l;
+    }
+
+    static unsigned* riseTable()
+    {
+        static unsigned r[count]{};
+        return r;
+    }
+};
+
+} // namespace host
+
+inline void pinMode(uint8_t pin, uint8_t mode) { host::Pins::mode(pin, mode); }
+
+inline void digitalWrite(uint8_t pin, uint8_t val) { host::Pins::write(pin, val); }
+
+class Print {
+public:
+    virtual ~Print() = default;
+
+    virtual size_t write(uint8_t c) = 0;
+
+    virtual size_t write(const uint8_t* buf, size_t len)
+    {
+        size_t n = 0;
+        while (len--) {
+            n += write(*buf++);
+        }
+        return n;
+    }
+
+    size_t write(const char* buf, size_t len)
+    {
+        return write(reinterpret_cast<const uint8_t*>(buf), len);
+    }
+
+    size_t write(const char* s) { return s ? write(s, strlen(s)) : 0; }
+
+    virtual int availableForWrite() { return 0; }
+
+    size_t print(const char* s) { return write(s); }
+
+    size_t print(char c) { return write(static_cast<uint8_t>(c)); }
+
+    size_t print(unsigned char v) { return print(static_cast<unsigned long>(v)); }
+
+    size_t print(int v) { return print(static_cast<long>(v)); }
+
+    size_t print(unsigned v) { return print(static_cast<unsigned long>(v)); }
+
+    size_t print(long v) { return format("%ld", v); }
+
+    size_t print(unsigned long v) { return format("%lu", v); }
+
+    size_t print(double v, int decimals = 2) { return format("%.*f", decimals, v); }
+
+    size_t println() { return write("\r\n"); }
+
+private:
+    template <typename... Ts>
+    size_t format(const char* fmt, Ts... ts)
+    {
+        char buf[32];
+        const int n = snprintf(buf, sizeof(buf), fmt, ts...);
+        return n > 0 ? write(buf, min(static_cast<size_t>(n), sizeof(buf) - 1)) : 0;
+    }
+};
@@ -0,0 +1,99 @@
+#pragma once
+
+// Host build stand-in for the Arduino core Stream, reads give up at once instead of waiting for
+// the timeout, as nothing can arrive while the caller blocks.
+
+#include "Print.h"
+
+#include <string>
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+
+    virtual int read() = 0;
+
+    virtual int peek() = 0;
+
+    virtual void flush() {}
+
+    size_t readBytes(uint8_t* buf, size_t len)
+    {
+        size_t n = 0;
+        for (int c; n < len && (c = read()) >= 0;) {
+            buf[n++] = static_cast<uint8_t>(c);
+        }
+        return n;
+    }
+
+    size_t readBytes(char* buf, size_t len)
+    {
+        return readBytes(reinterpret_cast<uint8_t*>(buf), len);
+    }
+
+    size_t readBytesUntil(char end, char* buf, size_t len)
+    {
+        size_t n = 0;
+        for (int c; n < len && (c = read()) >= 0 && c != end;) {
+            buf[n++] = static_cast<char>(c);
+        }
+        return n;
+    }
+};
+
+namespace host {
+
+// Serial link to the PC: input is queued by the code driving the firmware, output is collected.
+// Room for writes is the free space of the UART transmit buffer, which drains at the baud rate,
+// or is always free with zero baud rate.
+class Terminal : public Stream {
+public:
+    using Print::write;
+
+    explicit Terminal(unsigned long baud = 0, int room = 64) : baud_(baud), room_(room) {}
+
+    void send(const std::string& s) { in_ += s; }
+
+    // Output collected since the last call.
+    std::string take()
+    {
+        std::string s;
+        s.swap(out_);
+        return s;
+    }
+
+    // Time the last written byte leaves the wire, us.
+    unsigned long sentUs() const { return max(sentUs_, Clock::us()); }
+
+    size_t write(uint8_t c) override
+    {
+        out_ += static_cast<char>(c);
+        sentUs_ = sentUs() + byteUs();
+        return 1;
+    }
+
+    int availableForWrite() override
+    {
+        const unsigned long us = byteUs();
+        return us ? room_ - static_cast<int>((sentUs() - Clock::us() + us - 1) / us) : room_;
+    }
+
+    int available() override { return static_cast<int>(in_.size() - pos_); }
+
+    int read() override { return pos_ < in_.size() ? static_cast<uint8_t>(in_[pos_++]) : -1; }
+
+    int peek() override { return pos_ < in_.size() ? static_cast<uint8_t>(in_[pos_]) : -1; }
+
+private:
+    // Start bit, 8 data bits and stop bit.
+    unsigned long byteUs() const { return baud_ ? 10000000ul / baud_ : 0; }
+
+    unsigned long baud_;
+    int room_;
+    std::string in_;
+    size_t pos_{};
+    std::string out_;
+    unsigned long sentUs_{};
+};
+
+} // namespace host
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace gservo {
+
+// Traits of a servo series: units of its control table values, limits, register addresses and
+// which features the series has. Register addresses of absent features are 0.
+
+// AX-12A, AX-18A. Compliance margins and slopes take the place of PID gains.
+struct Ax {
+    static constexpr float unitDeg = 300.f / 1023.f;
+    static constexpr float unitDegPerMin = 0.111f * 360.f;
+    static constexpr float unitDegPerSec2 = 0.f;
+
+    static constexpr uint16_t maxPos = 1023;
+    static constexpr uint16_t maxSpeed = 1023;
+    static constexpr uint16_t maxAcc = 0;
+
+    // Joint mode over the whole range.
+    static constexpr uint16_t limitCw = 0;
+    static constexpr uint16_t limitCcw = 1023;
+
+    static constexpr bool hasAcc = false;
+    static constexpr bool hasPid = false;
+
+    enum : uint8_t {
+        regLimits = 0X06,
+        regTorqueMax = 0X0E,
+        regLed = 0X19,
+        regGains = 0,
+        regGoalPos = 0X1E,
+        regSpeed = 0X20,
+        regPresent = 0X24,
+        regPunch = 0X30,
+        regAcc = 0,
+    };
+};
+
+// MX-12W, MX-28, MX-64, MX-106 with Protocol 1.0 firmware.
+struct Mx {
+    static constexpr float unitDeg = 0.088f;
+    static constexpr float unitDegPerMin = 0.916f * 360.f;
+    static constexpr float unitDegPerSec2 = 8.583f;
+
+    static constexpr uint16_t maxPos = 0xFFF;
+    static constexpr uint16_t maxSpeed = 1023;
+    static constexpr uint16_t maxAcc = 254;
+
+    // Both limits at maximum select multi-turn mode.
+    static constexpr uint16_t limitCw = 0xFFF;
+    static constexpr uint16_t limitCcw = 0xFFF;
+
+    static constexpr bool hasAcc = true;
+    static constexpr bool hasPid = true;
+
+    enum : uint8_t {
+        regLimits = 0X06,
+        regTorqueMax = 0X0E,
+        regLed = 0X19,
+        regGains = 0X1A,
+        regGoalPos = 0X1E,
+        regSpeed = 0X20,
+        regPresent = 0X24,
+        regPunch = 0X30,
+        regAcc = 0X49,
+    };
+};
+
+namespace models {
+constexpr bool any() { return false; }
+
+template <typename... Bs>
+constexpr bool any(bool b, Bs... bs)
+{
+    return b || any(bs...);
+}
+
+// Address of a register in the models which have it, 0 when none has.
+constexpr uint8_t reg() { return 0; }
+
+template <typename... Ts>
+constexpr uint8_t reg(uint8_t a, Ts... ts)
+{
+    return a ? a : reg(ts...);
+}
+
+// Whether every model which has the register keeps it at address r.
+constexpr bool at(uint8_t) { return true; }
+
+template <typename... Ts>
+constexpr bool at(uint8_t r, uint8_t a, Ts... ts)
+{
+    return (a == 0 || a == r) && at(r, ts...);
+}
+
+template <typename T>
+constexpr bool same(T) { return true; }
+
+template <typename T, typename... Ts>
+constexpr bool same(T a, T b, Ts... ts)
+{
+    return a == b && same(b, ts...);
+}
+} // namespace models
+
+// Per-axis traits, the first model is for axis x, then y and so on. Values are gathered into
+// arrays indexed by axis, summary flags let code for features no axis has drop out.
+template <typename... Ms>
+struct Models {
+    static constexpr int count = sizeof...(Ms);
+
+    static constexpr float unitDeg[]{Ms::unitDeg...};
+    static constexpr float unitDegPerMin[]{Ms::unitDegPerMin...};
+    static constexpr float unitDegPerSec2[]{Ms::unitDegPerSec2...};
+    static constexpr uint16_t maxPos[]{Ms::maxPos...};
+    static constexpr uint16_t maxSpeed[]{Ms::maxSpeed...};
+    static constexpr uint16_t maxAcc[]{Ms::maxAcc...};
+    static constexpr uint16_t limitCw[]{Ms::limitCw...};
+    static constexpr uint16_t limitCcw[]{Ms::limitCcw...};
+    static constexpr bool hasAcc[]{Ms::hasAcc...};
+    static constexpr bool hasPid[]{Ms::hasPid...};
+
+    static constexpr bool anyAcc = models::any(Ms::hasAcc...);
+    static constexpr bool anyPid = models::any(Ms::hasPid...);
+
+    // Register addresses, for axes which have the register. A bus takes one address per
+    // register, as one sync write goes to all servos.
+    static constexpr uint8_t regLimits = models::reg(Ms::regLimits...);
+    static constexpr uint8_t regTorqueMax = models::reg(Ms::regTorqueMax...);
+    static constexpr uint8_t regLed = models::reg(Ms::regLed...);
+    static constexpr uint8_t regGains = models::reg(Ms::regGains...);
+    static constexpr uint8_t regGoalPos = models::reg(Ms::regGoalPos...);
+    static constexpr uint8_t regSpeed = models::reg(Ms::regSpeed...);
+    static constexpr uint8_t regPresent = models::reg(Ms::regPresent...);
+    static constexpr uint8_t regPunch = models::reg(Ms::regPunch...);
+    static constexpr uint8_t regAcc = models::reg(Ms::regAcc...);
+    static_assert(models::at(regLimits, Ms::regLimits...)
+                  && models::at(regTorqueMax, Ms::regTorqueMax...)
+                  && models::at(regLed, Ms::regLed...)
+                  && models::at(regGains, Ms::regGains...)
+                  && models::at(regGoalPos, Ms::regGoalPos...)
+                  && models::at(regSpeed, Ms::regSpeed...)
+                  && models::at(regPresent, Ms::regPresent...)
+                  && models::at(regPunch, Ms::regPunch...)
+                  && models::at(regAcc, Ms::regAcc...),
+                  "models on one bus keep a register at different addresses");
+
+    // Same joint mode limits on every axis can go in one broadcast write.
+    static constexpr bool sameLimits =
+            models::same(Ms::limitCw...) && models::same(Ms::limitCcw...);
+};
+
+template <typename... Ms>
+constexpr float Models<Ms...>::unitDeg[];
+template <typename... Ms>
+constexpr float Models<Ms...>::unitDegPerMin[];
+template <typename... Ms>
+constexpr float Models<Ms...>::unitDegPerSec2[];
+template <typename... Ms>
+constexpr uint16_t Models<Ms...>::maxPos[];
+template <typename... Ms>
+constexpr uint16_t Models<Ms...>::maxSpeed[];
+template <typename... Ms>
+constexpr uint16_t Models<Ms...>::maxAcc[];
+template <typename... Ms>
+constexpr uint16_t Models<Ms...>::limitCw[];
+template <typename... Ms>
+constexpr uint16_t Models<Ms...>::limitCcw[];
+template <typename... Ms>
+constexpr bool Models<Ms...>::hasAcc[];
+template <typename... Ms>
+constexpr bool Models<Ms...>::hasPid[];
+
+// Models<M, M, ...> with N axes of the same model.
+template <typename M, int N, typename... Ms>
+struct Same : Same<M, N - 1, M, Ms...> {};
+
+template <typename M, typename... Ms>
+struct Same<M, 0, Ms...> {
+    using type = Models<Ms...>;
+};
+
+} // namespace gservo
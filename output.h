@@ -0,0 +1,436 @@
+#pragma once
+
+#include "parser.h"
+
+#include <Print.h>
+
+#ifndef GSERVO_OUT_URGENT
+#define GSERVO_OUT_URGENT 96
+#endif
+
+#ifndef GSERVO_OUT_BULK
+#define GSERVO_OUT_BULK 128
+#endif
+
+#ifndef GSERVO_OUT_STALL_MS
+#define GSERVO_OUT_STALL_MS 500
+#endif
+
+namespace gservo {
+
+template <unsigned Size>
+class RingBuf {
+public:
+    unsigned size() const { return len_; }
+
+    unsigned room() const { return Size - len_; }
+
+    bool empty() const { return len_ == 0; }
+
+    void push(uint8_t c)
+    {
+        buf_[wrap(head_ + len_)] = c;
+        ++len_;
+    }
+
+    uint8_t peek(unsigned i = 0) const { return buf_[wrap(head_ + i)]; }
+
+    // Contiguous run of queued bytes starting from the head.
+    const uint8_t* front(unsigned& len) const
+    {
+        len = head_ + len_ > Size ? Size - head_ : len_;
+        return buf_ + head_;
+    }
+
+    void pop(unsigned n = 1)
+    {
+        head_ = wrap(head_ + n);
+        len_ -= n;
+    }
+
+private:
+    static unsigned wrap(unsigned i) { return i >= Size ? i - Size : i; }
+
+    uint8_t buf_[Size]{};
+    unsigned head_{};
+    unsigned len_{};
+};
+
+// Print that never blocks the caller: bytes are queued and moved to the sink from the main loop.
+class Output : public Print {
+public:
+    enum class Prio : uint8_t {
+        Bulk = 0,
+        Urgent = 1,
+    };
+
+    using Print::write;
+
+    // Lane used by the following writes. Urgent messages are sent ahead of queued bulk text,
+    // at the nearest line boundary.
+    virtual void prio(Prio p) = 0;
+
+    // Queues flash string by reference, it is read from flash only when sent.
+    virtual void pgm(GStr s) = 0;
+
+    // Bytes which can be written into the current lane without dropping.
+    virtual size_t room() = 0;
+
+    // Moves as much as sink can take without blocking.
+    virtual void drain() = 0;
+
+    virtual bool empty() const = 0;
+
+    // Text is still queued in the bulk lane, e.g. the reply of an earlier line.
+    virtual bool bulkQueued() const = 0;
+
+    // Bytes that did not fit and were thrown away.
+    virtual unsigned long dropped() const = 0;
+};
+
+class UrgentScope {
+public:
+    explicit UrgentScope(Output* o) : o_(o) { o_->prio(Output::Prio::Urgent); }
+
+    ~UrgentScope() { o_->prio(Output::Prio::Bulk); }
+
+    UrgentScope(const UrgentScope&) = delete;
+    UrgentScope& operator=(const UrgentScope&) = delete;
+
+private:
+    Output* o_;
+};
+
+class OutQueue final : public Output {
+public:
+    explicit OutQueue(Print* sink) : sink_(sink) {}
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+
+    size_t write(const uint8_t* buf, size_t len) override
+    {
+        if (prio_ == Prio::Urgent) {
+            // Partial status report is worse than none.
+            if (len > urgent_.room()) {
+                dropped_ += len;
+                return 0;
+            }
+            for (size_t i = 0; i < len; ++i) {
+                urgent_.push(buf[i]);
+            }
+            return len;
+        }
+        size_t n = 0;
+        for (; n < len; ++n) {
+            if (buf[n] == 0) {
+                // Zero byte is a flash reference marker, escape it as a null reference.
+                if (!pushRef(nullptr)) {
+                    break;
+                }
+            }
+            else if (bulk_.room() > 0) {
+                bulk_.push(buf[n]);
+            }
+            else {
+                break;
+            }
+        }
+        dropped_ += len - n;
+        return n;
+    }
+
+    void prio(Prio p) override { prio_ = p; }
+
+    void pgm(GStr s) override
+    {
+        if (!s) {
+            return;
+        }
+        if (prio_ == Prio::Urgent || !pushRef(s)) {
+            auto p = reinterpret_cast<const char*>(s);
+            while (pgm_read_byte(p++)) {
+                ++dropped_;
+            }
+        }
+    }
+
+    size_t room() override
+    {
+        return prio_ == Prio::Urgent ? urgent_.room() : bulk_.room();
+    }
+
+    void drain() override
+    {
+        int avail = sink_->availableForWrite();
+        if (empty() || avail > 0) {
+            lastSent_ = millis();
+        }
+        while (avail > 0) {
+            if (!urgent_.empty() && lineStart_) {
+                avail -= sendUrgent(static_cast<unsigned>(avail));
+            }
+            else if (!bulk_.empty()) {
+                avail -= sendBulk(static_cast<unsigned>(avail));
+            }
+            else {
+                // Truncated line will never get its end, do not hold urgent lane because of it.
+                lineStart_ = true;
+                if (urgent_.empty()) {
+                    return;
+                }
+            }
+        }
+    }
+
+    bool empty() const override { return urgent_.empty() && bulk_.empty(); }
+
+    bool bulkQueued() const override { return !bulk_.empty(); }
+
+    unsigned long dropped() const override { return dropped_; }
+
+    // Sink took nothing for a while, e.g. Bluetooth link without a peer.
+    bool stalled() const { return !empty() && millis() - lastSent_ > GSERVO_OUT_STALL_MS; }
+
+private:
+    static constexpr uint8_t refMarker = 0;
+
+    bool pushRef(GStr s)
+    {
+        if (bulk_.room() < 1 + sizeof(s)) {
+            return false;
+        }
+        bulk_.push(refMarker);
+        uint8_t b[sizeof(s)];
+        memcpy(b, &s, sizeof(s));
+        for (auto c : b) {
+            bulk_.push(c);
+        }
+        return true;
+    }
+
+    GStr peekRef() const
+    {
+        uint8_t b[sizeof(GStr)];
+        for (unsigned i = 0; i < sizeof(b); ++i) {
+            b[i] = bulk_.peek(1 + i);
+        }
+        GStr s;
+        memcpy(&s, b, sizeof(s));
+        return s;
+    }
+
+    unsigned sendUrgent(unsigned avail)
+    {
+        unsigned len{};
+        const auto p = urgent_.front(len);
+        len = min(len, avail);
+        sink_->write(p, len);
+        urgent_.pop(len);
+        return len;
+    }
+
+    unsigned sendBulk(unsigned avail)
+    {
+        if (bulk_.peek() == refMarker) {
+            return sendRef(avail);
+        }
+        unsigned len{};
+        const auto p = urgent_.empty() ? bulk_.front(len) : lineEnd(avail, len);
+        len = min(len, avail);
+        for (unsigned i = 0; i < len; ++i) {
+            if (p[i] == refMarker) {
+                len = i;
+                break;
+            }
+        }
+        sink_->write(p, len);
+        lineStart_ = p[len - 1] == '\n';
+        bulk_.pop(len);
+        return len;
+    }
+
+    // Bytes up to and including the first line end, so urgent lane can take over after it.
+    const uint8_t* lineEnd(unsigned avail, unsigned& len) const
+    {
+        const auto p = bulk_.front(len);
+        for (unsigned i = 0; i < len && i < avail; ++i) {
+            if (p[i] == '\n') {
+                len = i + 1;
+                break;
+            }
+        }
+        return p;
+    }
+
+    unsigned sendRef(unsigned avail)
+    {
+        const auto s = peekRef();
+        if (!s) {
+            sink_->write(uint8_t{0});
+            bulk_.pop(1 + sizeof(s));
+            return 1;
+        }
+        auto p = reinterpret_cast<const char*>(s) + refPos_;
+        uint8_t buf[16];
+        unsigned len = 0;
+        for (char c; len < sizeof(buf) && len < avail && (c = pgm_read_byte(p + len));) {
+            buf[len++] = static_cast<uint8_t>(c);
+            if (c == '\n' && !urgent_.empty()) {
+                break;
+            }
+        }
+        if (len == 0) {
+            bulk_.pop(1 + sizeof(s));
+            refPos_ = 0;
+            // Nothing was sent, but the reference is consumed.
+            return 0;
+        }
+        sink_->write(buf, len);
+        lineStart_ = buf[len - 1] == '\n';
+        refPos_ += len;
+        return len;
+    }
+
+    Print* sink_;
+    RingBuf<GSERVO_OUT_URGENT> urgent_;
+    RingBuf<GSERVO_OUT_BULK> bulk_;
+    Prio prio_{Prio::Bulk};
+    bool lineStart_{true};
+    unsigned refPos_{};
+    unsigned long dropped_{};
+    unsigned long lastSent_{};
+};
+
+// Fans output out to several sinks, each behind its own queue, so a slow or blocked sink drops
+// its own bytes instead of throttling the others. Sinks are fixed, or up to N come and go.
+template <int N>
+class JoinPrint final : public Output {
+public:
+    JoinPrint() = default;
+
+    template <typename... Q>
+    explicit JoinPrint(Q*... q) : q_{q...}
+    {
+        static_assert(sizeof...(Q) == N, "one queue per sink");
+    }
+
+    // False when all N places are taken. A queue already attached keeps its one place, even if a
+    // place before it has been freed since.
+    bool attach(OutQueue* q)
+    {
+        OutQueue** free = nullptr;
+        for (auto& p : q_) {
+            if (p == q) {
+                return true;
+            }
+            if (!p && !free) {
+                free = &p;
+            }
+        }
+        if (free) {
+            *free = q;
+        }
+        return free != nullptr;
+    }
+
+    void detach(OutQueue* q)
+    {
+        for (auto& p : q_) {
+            if (p == q) {
+                p = nullptr;
+            }
+        }
+    }
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+
+    // Returns bytes accepted by every sink which still takes data, stalled ones drop theirs.
+    size_t write(const uint8_t* buf, size_t len) override
+    {
+        size_t w = len;
+        for (auto q : q_) {
+            if (q) {
+                const bool stalled = q->stalled();
+                const size_t n = q->write(buf, len);
+                w = stalled ? w : min(w, n);
+            }
+        }
+        return w;
+    }
+
+    void prio(Prio p) override
+    {
+        for (auto q : q_) {
+            if (q) {
+                q->prio(p);
+            }
+        }
+    }
+
+    void pgm(GStr s) override
+    {
+        for (auto q : q_) {
+            if (q) {
+                q->pgm(s);
+            }
+        }
+    }
+
+    // Paced by the slowest sink which still takes data, stalled ones are not waited for. With
+    // none of them long outputs go on and are dropped, so they do not hold the next lines.
+    size_t room() override
+    {
+        size_t r = GSERVO_OUT_BULK;
+        for (auto q : q_) {
+            if (q && !q->stalled()) {
+                r = min(r, q->room());
+            }
+        }
+        return r;
+    }
+
+    void drain() override
+    {
+        for (auto q : q_) {
+            if (q) {
+                q->drain();
+            }
+        }
+    }
+
+    bool empty() const override
+    {
+        for (auto q : q_) {
+            if (q && !q->empty()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool bulkQueued() const override
+    {
+        for (auto q : q_) {
+            if (q && q->bulkQueued()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    unsigned long dropped() const override
+    {
+        unsigned long d = 0;
+        for (auto q : q_) {
+            if (q) {
+                d += q->dropped();
+            }
+        }
+        return d;
+    }
+
+private:
+    OutQueue* q_[N]{};
+};
+
+} // namespace gservo
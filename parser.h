@@ -1,20 +1,27 @@
 #pragma once
 
+#include "program.h"
+
+#include <ctype.h>
 #include <inttypes.h>
 #include <math.h>
+#include <string.h>
 
 namespace gservo {
 
 #ifndef PROGMEM
+#define PROGMEM
 #define __FlashStringHelper char
 #define PSTR(s) s
 #define F(s) s
+#define pgm_read_byte(p) (*reinterpret_cast<const uint8_t*>(p))
+#define memcpy_P memcpy
 #endif
 using GStr = const __FlashStringHelper*;
 
-constexpr int COORDS = 2;
-
-constexpr char coordNames[COORDS]{'x', 'y'};
+// Axis words in order of axes, a build with N axes uses the first N.
+constexpr char coordNames[]{'x', 'y', 'z', 'a', 'b', 'c'};
+constexpr int maxCoords = sizeof(coordNames);
 
 template <typename T, typename TMin, typename TMax>
 inline T clamp(T val, TMin minV, TMax maxV)
@@ -22,19 +29,21 @@ inline T clamp(T val, TMin minV, TMax maxV)
     return val > maxV ? maxV : val < minV ? minV : val;
 }
 
-template <typename T>
+template <typename T, int N>
 struct Vec {
-    T coord[COORDS];
+    static_assert(N > 0 && N <= maxCoords, "unsupported number of axes");
+
+    T coord[N];
 
     T* begin() { return coord; }
 
-    T* end() { return coord + COORDS; }
+    T* end() { return coord + N; }
 
     T& operator[](int i) { return coord[i]; }
 
     const T* begin() const { return coord; }
 
-    const T* end() const { return coord + COORDS; }
+    const T* end() const { return coord + N; }
 
     T operator[](int i) const { return coord[i]; }
 
@@ -50,20 +59,20 @@ struct Vec {
     static Vec ofNaN() { return ofConst(NAN); }
 
     template <typename M>
-    Vec<M> cast() const
+    Vec<M, N> cast() const
     {
-        Vec<M> v{};
-        for (int i = 0; i < COORDS; ++i) {
+        Vec<M, N> v{};
+        for (int i = 0; i < N; ++i) {
             v[i] = static_cast<M>(coord[i]);
         }
         return v;
     }
 
     template <typename M>
-    Vec<M> round() const
+    Vec<M, N> round() const
     {
-        Vec<M> v{};
-        for (int i = 0; i < COORDS; ++i) {
+        Vec<M, N> v{};
+        for (int i = 0; i < N; ++i) {
             v[i] = static_cast<M>(lroundf(coord[i]));
         }
         return v;
@@ -111,7 +120,7 @@ struct Vec {
 
     Vec& operator+=(const Vec& v)
     {
-        for (int i = 0; i < COORDS; ++i) {
+        for (int i = 0; i < N; ++i) {
             coord[i] += v.coord[i];
         }
         return *this;
@@ -126,7 +135,7 @@ struct Vec {
     Vec operator-() const
     {
         Vec v{};
-        for (int i = 0; i < COORDS; ++i) {
+        for (int i = 0; i < N; ++i) {
             v[i] = -coord[i];
         }
         return v;
@@ -134,7 +143,7 @@ struct Vec {
 
     Vec& operator-=(const Vec& v)
     {
-        for (int i = 0; i < COORDS; ++i) {
+        for (int i = 0; i < N; ++i) {
             coord[i] -= v.coord[i];
         }
         return *this;
@@ -148,7 +157,7 @@ struct Vec {
 
     Vec& operator*=(const Vec& v)
     {
-        for (int i = 0; i < COORDS; ++i) {
+        for (int i = 0; i < N; ++i) {
             coord[i] *= v.coord[i];
         }
         return *this;
@@ -162,7 +171,7 @@ struct Vec {
 
     Vec& operator/=(const Vec& v)
     {
-        for (int i = 0; i < COORDS; ++i) {
+        for (int i = 0; i < N; ++i) {
             coord[i] /= v.coord[i];
         }
         return *this;
@@ -176,7 +185,7 @@ struct Vec {
 
     friend bool operator==(const Vec& lhs, const Vec& rhs)
     {
-        for (int i = 0; i < COORDS; ++i) {
+        for (int i = 0; i < N; ++i) {
             if (lhs[i] != rhs[i]) {
                 return false;
             }
@@ -187,23 +196,27 @@ struct Vec {
     friend bool operator!=(const Vec& lhs, const Vec& rhs) { return !(rhs == lhs); }
 };
 
-template <typename T, typename TMin, typename TMax>
-Vec<T> clampEach(Vec<T> val, TMin vMin, TMax vMax)
+template <typename T, int N, typename TMin, typename TMax>
+Vec<T, N> clampEach(Vec<T, N> val, TMin vMin, TMax vMax)
 {
-    for (int i = 0; i < COORDS; ++i) {
+    for (int i = 0; i < N; ++i) {
         val[i] = clamp(val[i], vMin, vMax);
     }
     return val;
 }
 
-using FVec = Vec<float>;
-using IVec = Vec<int>;
+template <int N>
+using FVec = Vec<float, N>;
+
+template <int N>
+using IVec = Vec<int, N>;
 
 enum class Mode : unsigned {
     Fast = 0,
     Normal = 1,
 };
 
+template <int N>
 class Callbacks {
 public:
     virtual ~Callbacks() = default;
@@ -218,12 +231,36 @@ public:
 
     virtual void setSpeed(float val) = 0;
 
-    virtual void move(const FVec& pos, bool report) = 0;
+    virtual void selectProfile(unsigned n) = 0;
+
+    virtual void move(const FVec<N>& pos, bool report) = 0;
+
+    // Target sample of the tracking mode taken at sender time ts, ms.
+    virtual void track(unsigned long ts, const FVec<N>& pos) = 0;
 
     virtual void reportCurrentPos() = 0;
 
+    // Lines after it wait until the motion ends and then for ms.
+    virtual void dwell(unsigned long ms) = 0;
+
     virtual void setSetting(unsigned s, float val, bool hasVal) = 0;
 
+    // Lines after it up to endProgram() are stored as program k, false when they should not be.
+    virtual bool beginProgram(unsigned k) = 0;
+
+    // Line of the program being stored, in tokens of program.h.
+    virtual void programLine(const uint8_t* tokens, int len) = 0;
+
+    virtual void endProgram() = 0;
+
+    // Runs program k count times, 1 to 65535, with #1..#n taking params, its ack comes at the end.
+    virtual void callProgram(unsigned k, unsigned count, const float* params, int n) = 0;
+
+    virtual void listProgram(unsigned k) = 0;
+
+    // Pictures covering span around the current position, rows for pattern 0, spiral for 1.
+    virtual void scan(const FVec<N>& span, unsigned pattern) = 0;
+
     virtual void showSetting(unsigned s) = 0;
 	
     virtual void showSettings() = 0;
@@ -237,9 +274,10 @@ public:
     virtual void errorPos(char c, int i) = 0;
 };
 
+template <int N>
 class Parser {
 public:
-    Parser(Callbacks* cb) : cb_(cb) {}
+    Parser(Callbacks<N>* cb) : cb_(cb) {}
 
     void parse(const char* str, int len)
     {
@@ -247,7 +285,9 @@ public:
         pos_ = 0;
         len_ = len;
         while (pos_ < len_ && curr()) {
-            if (!parseLine()) {
+            // Stop and position requests are not stored, they act at once.
+            const bool store = recording_ && !check('o') && !check('?') && !check('!');
+            if (!(store ? recordLine() : parseLine())) {
                 cb_->errorPos(curr(), pos_);
 				cb_->eol();
                 skipLine();
@@ -275,7 +315,62 @@ private:
                 cb_->error(F("expect unsigned integer"));
                 return false;
             }
-            cb_->setMode(static_cast<Mode>(code));
+            if (code == 4) {
+                unsigned long ms{};
+                if (!consume('p') || !parseUnsigned(ms)) {
+                    cb_->error(F("expect dwell time"));
+                    return false;
+                }
+                cb_->dwell(ms);
+            }
+            else {
+                cb_->setMode(static_cast<Mode>(code));
+                if (!parseMove()) {
+                    cb_->error(F("expect move"));
+                    return false;
+                }
+            }
+        }
+        else if (consume('m')) {
+            unsigned code{};
+            if (!parseUnsigned(code) || code != 400) {
+                cb_->error(F("expect m400"));
+                return false;
+            }
+            cb_->dwell(0);
+        }
+        else if (consume('o')) {
+            if (!parseProgram()) {
+                return false;
+            }
+        }
+        else if (consumeWord("scan")) {
+            FVec<N> span = FVec<N>::ofNaN();
+            if (!parsePos(span) || !span.any()) {
+                cb_->error(F("expect scan span"));
+                return false;
+            }
+            unsigned pattern{};
+            if (consume('p') && !parseUnsigned(pattern)) {
+                cb_->error(F("expect scan pattern"));
+                return false;
+            }
+            cb_->scan(span, pattern);
+        }
+        else if (consume('@')) {
+            unsigned long ts{};
+            if (!parseUnsigned(ts)) {
+                cb_->error(F("expect timestamp"));
+                return false;
+            }
+            FVec<N> pos = FVec<N>::ofNaN();
+            if (!parsePos(pos) || !pos.any()) {
+                cb_->error(F("expect position"));
+                return false;
+            }
+            cb_->track(ts, pos);
+        }
+        else if (check('t')) {
             if (!parseMove()) {
                 cb_->error(F("expect move"));
                 return false;
@@ -317,8 +412,82 @@ private:
         return requireEol();
     }
 
+    // o<k> sub, o<k> endsub, o<k> call [v].. l<count> or o<k> list, only endsub while recording.
+    bool parseProgram()
+    {
+        unsigned k{};
+        if (!parseUnsigned(k)) {
+            cb_->error(F("expect program number"));
+            return false;
+        }
+        if (recording_) {
+            if (!consumeWord("endsub")) {
+                cb_->error(F("expect endsub"));
+                return false;
+            }
+            if (k != recorded_) {
+                cb_->error(F("endsub of another program"));
+                return false;
+            }
+            recording_ = false;
+            cb_->endProgram();
+        }
+        else if (consumeWord("sub")) {
+            recording_ = cb_->beginProgram(k);
+            recorded_ = k;
+        }
+        else if (consumeWord("call")) {
+            float params[prog::params];
+            int n = 0;
+            while (consume('[')) {
+                if (n == prog::params || !parseFloat(params[n]) || !consume(']')) {
+                    cb_->error(F("expect up to 4 parameters in brackets"));
+                    return false;
+                }
+                ++n;
+            }
+            unsigned long count = 1;
+            if (consume('l') && (!parseUnsigned(count) || count == 0 || count > 0xFFFF)) {
+                cb_->error(F("expect loop count"));
+                return false;
+            }
+            cb_->callProgram(k, static_cast<unsigned>(count), params, n);
+        }
+        else if (consumeWord("list")) {
+            cb_->listProgram(k);
+        }
+        else {
+            cb_->error(F("expect sub, call or list"));
+            return false;
+        }
+        return true;
+    }
+
+    // Line of the program being recorded goes to it in tokens instead of being run.
+    bool recordLine()
+    {
+        uint8_t tokens[prog::lineMax];
+        int used{};
+        const int n = prog::tokenize(c_ + pos_, len_ - pos_, tokens, prog::lineMax, used);
+        if (n < 0) {
+            cb_->error(F("bad program line"));
+            return false;
+        }
+        if (n > 1) {
+            cb_->programLine(tokens, n);
+        }
+        pos_ += used;
+        cb_->eol();
+        return true;
+    }
+
     bool parseMove()
     {
+        unsigned profile{};
+        bool hasProfile = false;
+        if (!parseProfile(profile, hasProfile)) {
+            return false;
+        }
         float speed{};
         bool hasSpeed = false;
         if (checkSpeed()) {
@@ -328,7 +497,7 @@ private:
             }
             hasSpeed = true;
         }
-        FVec pos = FVec::ofNaN();
+        FVec<N> pos = FVec<N>::ofNaN();
         if (!parsePos(pos)) {
             cb_->error(F("expect position"));
             return false;
@@ -340,6 +509,9 @@ private:
             }
             hasSpeed = true;
         }
+        if (!hasProfile && !parseProfile(profile, hasProfile)) {
+            return false;
+        }
         bool report = false;
         if (pos.any() && consume('m')) {
             if (!consume('2', false)) {
@@ -348,6 +520,9 @@ private:
             }
             report = true;
         }
+        if (hasProfile) {
+            cb_->selectProfile(profile);
+        }
         if (hasSpeed) {
             cb_->setSpeed(speed);
         }
@@ -357,6 +532,19 @@ private:
         return true;
     }
 
+    bool parseProfile(unsigned& profile, bool& hasProfile)
+    {
+        if (!consume('t')) {
+            return true;
+        }
+        if (!parseUnsigned(profile)) {
+            cb_->error(F("expect profile number"));
+            return false;
+        }
+        hasProfile = true;
+        return true;
+    }
+
     bool parseSetSetting()
     {
         unsigned s{};
@@ -403,7 +591,7 @@ private:
 
     bool checkCoord(int& i) const
     {
-        for (i = 0; i < COORDS; ++i) {
+        for (i = 0; i < N; ++i) {
             if (check(coordNames[i])) {
                 return true;
             }
@@ -411,7 +599,7 @@ private:
         return false;
     }
 
-    bool parsePos(FVec& pos)
+    bool parsePos(FVec<N>& pos)
     {
         int i{};
         while (checkCoord(i)) {
@@ -422,7 +610,7 @@ private:
         return true;
     }
 
-    bool parseCoord(FVec& pos, int coord)
+    bool parseCoord(FVec<N>& pos, int coord)
     {
         if (consume(coordNames[coord])) {
             if (!parseFloat(pos[coord])) {
@@ -482,15 +670,18 @@ private:
         return true;
     }
 
-    bool parseUnsigned(unsigned& i)
+    // A number too big for T saturates, so that range checks reject it instead of a wrapped value.
+    template <typename T>
+    bool parseUnsigned(T& i)
     {
         unsigned curr = 0;
         if (!consumeDigit(curr)) {
             return false;
         }
+        const T top = static_cast<T>(~T{});
         i = 0;
         do {
-            i = curr + i * 10;
+            i = i > (top - curr) / 10 ? top : static_cast<T>(curr + i * 10);
         } while (consumeDigit(curr));
         skip();
         return true;
@@ -544,6 +735,21 @@ private:
         return false;
     }
 
+    // Whole word w, in lower case, or nothing is taken.
+    bool consumeWord(const char* w)
+    {
+        int i = 0;
+        while (w[i] && pos_ + i < len_ && tolower(c_[pos_ + i]) == w[i]) {
+            ++i;
+        }
+        if (w[i] || (pos_ + i < len_ && isalpha(c_[pos_ + i]))) {
+            return false;
+        }
+        pos_ += i;
+        skip();
+        return true;
+    }
+
     bool requireEol()
     {
 		consume('\r');
@@ -555,10 +761,13 @@ private:
         return true;
     }
 
-    Callbacks* cb_{};
+    Callbacks<N>* cb_{};
     const char* c_{};
     int pos_{};
     int len_{};
+    bool recording_{};
+    // Number of the program being recorded, its endsub has to name it.
+    unsigned recorded_{};
 };
 
 } // namespace gservo
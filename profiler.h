@@ -0,0 +1,141 @@
+#pragma once
+
+#include "format.h"
+#include "parser.h"
+
+#include <Print.h>
+
+// Loop timing profiler, off by default: with 0 the sections and the %5, %6 commands compile out.
+#ifndef GSERVO_PROFILE
+#define GSERVO_PROFILE 0
+#endif
+
+namespace gservo {
+
+// Duration of each main loop section: count, min, max, mean and a log2 histogram, where bucket 0
+// counts durations under 32 us, bucket k from 16 * 2^k us and the last one everything longer.
+class Profiler {
+public:
+    enum Section : uint8_t {
+        Parse,
+        Bus,
+        Report,
+        Drain,
+        count,
+    };
+
+    static constexpr uint8_t buckets = 14;
+
+    struct Stats {
+        uint32_t n;
+        uint32_t min;
+        uint32_t max;
+        // 32 bits of microseconds wrap after 71 minutes of a section.
+        uint64_t sum;
+        uint16_t hist[buckets];
+    };
+
+    void add(Section s, unsigned long us)
+    {
+        auto& st = stats_[s];
+        const auto d = static_cast<uint32_t>(us);
+        if (st.n == 0 || d < st.min) {
+            st.min = d;
+        }
+        if (d > st.max) {
+            st.max = d;
+        }
+        ++st.n;
+        st.sum += d;
+        auto& h = st.hist[bucket(d)];
+        if (h != 0xFFFF) {
+            ++h;
+        }
+    }
+
+    void reset() { memset(stats_, 0, sizeof(stats_)); }
+
+    const Stats& stats(Section s) const { return stats_[s]; }
+
+    static uint8_t bucket(uint32_t us)
+    {
+        uint8_t k = 0;
+        for (us >>= 5; us && k < buckets - 1; us >>= 1) {
+            ++k;
+        }
+        return k;
+    }
+
+    // Prints a line of totals and a line of histogram per section, starting from `from` while
+    // each line surely fits into `room` bytes. Returns index to continue from or -1 when done.
+    // Lines printed by later loops include the time of the loops in between.
+    int print(Print& p, int from, size_t room) const
+    {
+        constexpr int lines = count * 2;
+        for (; from < lines && room >= lineMax; ++from, room -= lineMax) {
+            const auto& st = stats_[from / 2];
+            StrBuf<lineMax> line;
+            line.add(F("[MSG:Prof ")).add(name(static_cast<Section>(from / 2)));
+            if (from % 2 == 0) {
+                line.add(F(" n:")).add(static_cast<unsigned long>(st.n));
+                line.add(F(" min:")).add(static_cast<unsigned long>(st.min));
+                line.add(F(" mean:")).add(st.n ? static_cast<unsigned long>(st.sum / st.n) : 0ul);
+                line.add(F(" max:")).add(static_cast<unsigned long>(st.max));
+            }
+            else {
+                line.add(F(" log2:")).add(static_cast<unsigned>(st.hist[0]));
+                for (uint8_t k = 1; k < buckets; ++k) {
+                    line.add(',').add(static_cast<unsigned>(st.hist[k]));
+                }
+            }
+            line.add(']').add('\n');
+            p.write(line.data(), line.size());
+        }
+        return from < lines ? from : -1;
+    }
+
+private:
+    static constexpr size_t lineMax = 104;
+
+    static GStr name(Section s)
+    {
+        switch (s) {
+        case Parse:
+            return F("parse");
+        case Bus:
+            return F("bus");
+        case Report:
+            return F("report");
+        default:
+            return F("drain");
+        }
+    }
+
+    Stats stats_[count]{};
+};
+
+// Adds the time from construction to destruction to a section.
+class ProfileScope {
+public:
+    ProfileScope(Profiler& p, Profiler::Section s) : p_(p), s_(s), start_(micros()) {}
+
+    ~ProfileScope() { p_.add(s_, micros() - start_); }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    Profiler& p_;
+    Profiler::Section s_;
+    unsigned long start_;
+};
+
+} // namespace gservo
+
+// Times the rest of the enclosing block, nothing at all when the profiler is off.
+#if GSERVO_PROFILE
+#define GSERVO_PROFILE_SCOPE(profiler, section)                                                    \
+    gservo::ProfileScope profileScope_ { profiler, gservo::Profiler::section }
+#else
+#define GSERVO_PROFILE_SCOPE(profiler, section)
+#endif
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <ctype.h>
+#include <stdint.h>
+
+namespace gservo {
+
+// Stored programs are command lines in tokens: spaces are dropped but one between two letters,
+// which keeps a word such as scan apart from the axis after it, letters and signs stay as they
+// are and numbers take one byte up to 63, three bytes up to an int16 and five bytes with three
+// decimals otherwise. Parameters #1..#4 are placeholders replaced on each run.
+namespace prog {
+enum : uint8_t {
+    smallInt = 0x80,
+    smallIntMax = 0x3F,
+    int16 = 0xC0,
+    milli = 0xC1,
+    param = 0xC8,
+};
+
+constexpr int params = 4;
+
+// Tokens of one line, its end included.
+constexpr int lineMax = 32;
+
+// Text of one line made from them with parameter values.
+constexpr int textMax = 64;
+
+// Tokens of the line at s up to its end, which is kept as '\n', into out of max bytes. Returns
+// their length, -1 when they do not fit or a number or a parameter is wrong. used is what the
+// line took from s, its end included.
+inline int tokenize(const char* s, int len, uint8_t* out, int max, int& used)
+{
+    int n = 0;
+    int i = 0;
+    bool ok = true;
+    // Last token is a letter.
+    bool letter = false;
+    const auto put = [&](uint8_t b) {
+        if (n < max) {
+            out[n++] = b;
+        }
+        else {
+            ok = false;
+        }
+    };
+    while (i < len && s[i] && s[i] != '\n') {
+        const char c = s[i];
+        const bool num = isdigit(c) || c == '.'
+                || (c == '-' && i + 1 < len && (isdigit(s[i + 1]) || s[i + 1] == '.'));
+        if (c == ' ' || c == '\r' || c == '\t') {
+            ++i;
+            if (letter && i < len && isalpha(s[i])) {
+                put(' ');
+                letter = false;
+            }
+        }
+        else if (c == '#') {
+            const int k = i + 1 < len ? s[i + 1] - '0' : 0;
+            if (k < 1 || k > params) {
+                ok = false;
+                break;
+            }
+            put(static_cast<uint8_t>(param + k - 1));
+            letter = false;
+            i += 2;
+        }
+        else if (num) {
+            letter = false;
+            const bool neg = c == '-';
+            i += neg;
+            long whole = 0;
+            long frac = 0;
+            int decimals = -1;
+            for (; i < len && (isdigit(s[i]) || (s[i] == '.' && decimals < 0)); ++i) {
+                if (s[i] == '.') {
+                    decimals = 0;
+                }
+                else if (decimals < 0) {
+                    whole = whole * 10 + (s[i] - '0');
+                    ok = ok && whole < 2147483L;
+                }
+                else if (decimals < 3) {
+                    frac = frac * 10 + (s[i] - '0');
+                    ++decimals;
+                }
+            }
+            if (!ok) {
+                break;
+            }
+            if (decimals < 0 && !neg && whole <= smallIntMax) {
+                put(static_cast<uint8_t>(smallInt + whole));
+            }
+            else if (decimals < 0 && whole <= 32767) {
+                const auto v = static_cast<uint16_t>(neg ? -whole : whole);
+                put(int16);
+                put(static_cast<uint8_t>(v));
+                put(static_cast<uint8_t>(v >> 8));
+            }
+            else {
+                for (; decimals < 3; ++decimals) {
+                    frac *= 10;
+                }
+                const long m = whole * 1000 + frac;
+                const auto v = static_cast<uint32_t>(neg ? -m : m);
+                put(milli);
+                for (int b = 0; b < 4; ++b) {
+                    put(static_cast<uint8_t>(v >> (8 * b)));
+                }
+            }
+        }
+        else if (static_cast<uint8_t>(c) > ' ' && static_cast<uint8_t>(c) < 0x7F) {
+            put(static_cast<uint8_t>(tolower(c)));
+            letter = isalpha(c);
+            ++i;
+        }
+        else {
+            ok = false;
+            break;
+        }
+    }
+    put('\n');
+    used = i < len && s[i] == '\n' ? i + 1 : i;
+    return ok ? n : -1;
+}
+
+// Text of the line starting at token at, read by byte(i), into out, a StrBuf. Parameters take
+// their values, or stay as #k without them. Returns where the next line starts.
+template <typename Byte, typename Out>
+int detokenize(Byte byte, int at, int end, const float* values, Out& out)
+{
+    bool prevNum = false;
+    while (at < end) {
+        const uint8_t t = byte(at++);
+        if (t == '\n') {
+            break;
+        }
+        const bool num = t >= smallInt;
+        // Numbers in a row, e.g. of %0 id newId, stay apart.
+        if (num && prevNum) {
+            out.add(' ');
+        }
+        prevNum = num;
+        if (t < smallInt) {
+            out.add(static_cast<char>(t));
+        }
+        else if (t <= smallInt + smallIntMax) {
+            out.add(static_cast<unsigned>(t - smallInt));
+        }
+        else if (t == int16) {
+            const auto v = static_cast<uint16_t>(byte(at) | byte(at + 1) << 8);
+            at += 2;
+            out.add(static_cast<int>(static_cast<int16_t>(v)));
+        }
+        else if (t == milli) {
+            uint32_t v = 0;
+            for (int b = 0; b < 4; ++b) {
+                v |= static_cast<uint32_t>(byte(at++)) << (8 * b);
+            }
+            const auto m = static_cast<int32_t>(v);
+            if (m < 0) {
+                out.add('-');
+            }
+            const auto a = static_cast<unsigned long>(m < 0 ? -m : m);
+            out.add(a / 1000).add('.');
+            out.add(static_cast<char>('0' + a / 100 % 10));
+            out.add(static_cast<char>('0' + a / 10 % 10));
+            out.add(static_cast<char>('0' + a % 10));
+        }
+        else if (t >= param && t < param + params) {
+            const int k = t - param;
+            if (!values) {
+                out.add('#').add(k + 1);
+            }
+            else if (values[k] == static_cast<long>(values[k])) {
+                // Whole values fit words which take integers, e.g. the time of g4.
+                out.add(static_cast<long>(values[k]));
+            }
+            else {
+                out.fixed(values[k], 3);
+            }
+        }
+    }
+    out.add('\n');
+    return at;
+}
+} // namespace prog
+
+} // namespace gservo
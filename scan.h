@@ -0,0 +1,146 @@
+#pragma once
+
+#include "parser.h"
+
+namespace gservo {
+
+// Tiles of a panorama around a center: the first two axes are covered by pictures of the camera
+// field of view which overlap by the given part, the outer pictures fit the span. Rows go back and
+// forth, or a square spiral goes out from the middle picture.
+template <int N>
+class Scan {
+public:
+    enum class Pattern : uint8_t {
+        Rows,
+        Spiral,
+    };
+
+    static constexpr int maxTiles = 255;
+
+    // False when span, field of view or overlap give no tiles or too many of them. Axes without
+    // a span stay where they are.
+    bool start(const FVec<N>& center, const FVec<N>& span, const FVec<N>& fov, float overlap,
+               Pattern pattern)
+    {
+        pos_ = FVec<N>::ofNaN();
+        count_[1] = 1;
+        for (int i = 0; i < dims; ++i) {
+            count_[i] = 1;
+            step_[i] = 0.f;
+            first_[i] = center[i];
+            if (!span.has(i)) {
+                continue;
+            }
+            const float cover = fabsf(span[i]) - fov[i];
+            const float step = fov[i] * (1.f - overlap);
+            if (!(fov[i] > 0 && step > 0)) {
+                return false;
+            }
+            if (cover > 0) {
+                const float n = ceilf(cover / step) + 1.f;
+                if (n > maxTiles) {
+                    return false;
+                }
+                count_[i] = static_cast<uint8_t>(n);
+                // Evenly spread, so the overlap is at least the given one.
+                step_[i] = cover / (n - 1.f);
+                first_[i] = center[i] - cover / 2.f;
+            }
+            pos_[i] = center[i];
+        }
+        const int total = count_[0] * count_[1];
+        if (total > maxTiles) {
+            return false;
+        }
+        total_ = static_cast<uint8_t>(total);
+        pattern_ = pattern;
+        done_ = 0;
+        walk_ = Walk{};
+        active_ = true;
+        return true;
+    }
+
+    // Position of the next tile, false after the last one.
+    bool next(FVec<N>& pos)
+    {
+        if (!active_ || done_ >= total_) {
+            return false;
+        }
+        int cell[2]{};
+        if (pattern_ == Pattern::Spiral) {
+            spiral(cell);
+        }
+        else {
+            cell[0] = done_ % count_[0];
+            cell[1] = done_ / count_[0];
+            if (cell[1] % 2) {
+                cell[0] = count_[0] - 1 - cell[0];
+            }
+        }
+        ++done_;
+        pos = pos_;
+        for (int i = 0; i < dims; ++i) {
+            if (pos.has(i)) {
+                pos[i] = first_[i] + cell[i] * step_[i];
+            }
+        }
+        return true;
+    }
+
+    bool active() const { return active_; }
+
+    // Tiles given by next() so far.
+    uint8_t done() const { return done_; }
+
+    uint8_t total() const { return total_; }
+
+    void stop() { active_ = false; }
+
+private:
+    static constexpr int dims = N < 2 ? N : 2;
+
+    // Square spiral from the middle cell: right 1, up 1, left 2, down 2, right 3 and so on.
+    struct Walk {
+        int8_t x{};
+        int8_t y{};
+        uint8_t dir{};
+        uint8_t leg{1};
+        uint8_t left{1};
+    };
+
+    // Cells of the spiral outside the grid are passed over.
+    void spiral(int* cell)
+    {
+        static const int8_t dx[]{1, 0, -1, 0};
+        static const int8_t dy[]{0, 1, 0, -1};
+        const int mid[2]{(count_[0] - 1) / 2, (count_[1] - 1) / 2};
+        for (bool first = done_ == 0;; first = false) {
+            if (!first) {
+                walk_.x += dx[walk_.dir];
+                walk_.y += dy[walk_.dir];
+                if (--walk_.left == 0) {
+                    walk_.dir = (walk_.dir + 1) % 4;
+                    walk_.leg += walk_.dir % 2 == 0;
+                    walk_.left = walk_.leg;
+                }
+            }
+            cell[0] = mid[0] + walk_.x;
+            cell[1] = mid[1] + walk_.y;
+            if (cell[0] >= 0 && cell[0] < count_[0] && cell[1] >= 0 && cell[1] < count_[1]) {
+                return;
+            }
+        }
+    }
+
+    FVec<N> pos_{};
+    float first_[2]{};
+    float step_[2]{};
+    uint8_t count_[2]{};
+    uint8_t total_{};
+    uint8_t done_{};
+    Walk walk_{};
+    Pattern pattern_{};
+    bool active_{};
+};
+
+} // namespace gservo
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "format.h"
+#include "parser.h"
+
+#include <Print.h>
+
+namespace gservo {
+
+// Task table as shown by %7.
+class Tasks {
+public:
+    // Prints a line per task starting from `from` while each line surely fits into `room` bytes.
+    // Returns index to continue from or -1 when all tasks were printed.
+    virtual int print(Print& p, int from, size_t room) const = 0;
+
+    // Clears the accounting.
+    virtual void reset() = 0;
+};
+
+// Cooperative scheduler of up to Max tasks. Each run() starts the most urgent due task, a task
+// is due when its period has passed. Tasks with zero period are due once per round, so a busy one
+// can not starve the others. Priority 0 is the most urgent. A task starts only when its time
+// budget fits before the next start of every more urgent task, so optional work can not delay
+// the control tick: it is deferred and a shorter task may go instead.
+template <uint8_t Max>
+class Scheduler final : public Tasks {
+    static_assert(Max <= 16, "round and held are 16 bit masks");
+
+public:
+    using Fn = void (*)(void* ctx);
+
+    struct Task {
+        Fn fn;
+        void* ctx;
+        GStr name;
+        unsigned long periodUs;
+        unsigned long next;
+        uint16_t budgetUs;
+        uint8_t prio;
+        // Accounting: starts, the longest run, runs over the budget, missed periods and times
+        // the task was due but put off for a more urgent one, once until it starts again.
+        unsigned long runs;
+        unsigned long maxUs;
+        uint16_t overruns;
+        uint16_t late;
+        uint16_t deferred;
+    };
+
+    // Returns the task index or -1 when the table is full.
+    int add(GStr name, Fn fn, void* ctx, unsigned long periodUs, uint8_t prio, uint16_t budgetUs)
+    {
+        if (n_ >= Max) {
+            return -1;
+        }
+        tasks_[n_] = Task{fn, ctx, name, periodUs, micros(), budgetUs, prio, 0, 0, 0, 0, 0};
+        return n_++;
+    }
+
+    const Task& task(int i) const { return tasks_[i]; }
+
+    // Runs at most one task, returns false when nothing was due.
+    bool run()
+    {
+        const auto now = micros();
+        int best = pick(now);
+        if (best < 0 && round_) {
+            round_ = 0;
+            best = pick(now);
+        }
+        if (best < 0) {
+            return false;
+        }
+        auto& t = tasks_[best];
+        if (t.periodUs) {
+            t.next += t.periodUs;
+            // Missed periods are not made up for, the task keeps its rate from now on.
+            if (static_cast<long>(now - t.next) >= 0) {
+                bump(t.late);
+                t.next = now + t.periodUs;
+            }
+        }
+        else {
+            round_ |= 1u << best;
+        }
+        held_ &= ~(1u << best);
+        t.fn(t.ctx);
+        const auto d = micros() - now;
+        ++t.runs;
+        if (d > t.maxUs) {
+            t.maxUs = d;
+        }
+        if (d > t.budgetUs) {
+            bump(t.overruns);
+        }
+        return true;
+    }
+
+    void reset() override
+    {
+        for (int i = 0; i < n_; ++i) {
+            auto& t = tasks_[i];
+            t.runs = t.maxUs = 0;
+            t.overruns = t.late = t.deferred = 0;
+        }
+    }
+
+    int print(Print& p, int from, size_t room) const override
+    {
+        for (; from < n_ && room >= lineMax; ++from, room -= lineMax) {
+            const auto& t = tasks_[from];
+            StrBuf<lineMax> line;
+            line.add(F("[MSG:Task ")).add(t.name).add(F(" runs:")).add(t.runs);
+            line.add(F(" max:")).add(t.maxUs);
+            line.add(F(" over:")).add(static_cast<unsigned>(t.overruns));
+            line.add(F(" late:")).add(static_cast<unsigned>(t.late));
+            line.add(F(" defer:")).add(static_cast<unsigned>(t.deferred)).add(F("]\n"));
+            p.write(line.data(), line.size());
+        }
+        return from < n_ ? from : -1;
+    }
+
+private:
+    static constexpr size_t lineMax = 96;
+
+    static void bump(uint16_t& c)
+    {
+        if (c != 0xFFFF) {
+            ++c;
+        }
+    }
+
+    // The most urgent due task which fits, -1 when none.
+    int pick(unsigned long now)
+    {
+        int best = -1;
+        for (int i = 0; i < n_; ++i) {
+            auto& t = tasks_[i];
+            if (!due(i, now)) {
+                continue;
+            }
+            if (!fits(t, now)) {
+                if (!(held_ & 1u << i)) {
+                    held_ |= 1u << i;
+                    bump(t.deferred);
+                }
+            }
+            else if (best < 0 || t.prio < tasks_[best].prio) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    bool due(int i, unsigned long now) const
+    {
+        const auto& t = tasks_[i];
+        return t.periodUs ? static_cast<long>(now - t.next) >= 0 : !(round_ & 1u << i);
+    }
+
+    bool fits(const Task& t, unsigned long now) const
+    {
+        for (int i = 0; i < n_; ++i) {
+            const auto& u = tasks_[i];
+            if (u.prio < t.prio && u.periodUs && static_cast<long>(u.next - now) < t.budgetUs) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Task tasks_[Max]{};
+    uint8_t n_{};
+    // Tasks with zero period which ran in this round.
+    uint16_t round_{};
+    // Tasks put off since their last start, a wait is counted once however many passes it takes.
+    uint16_t held_{};
+};
+
+} // namespace gservo
@@ -0,0 +1,556 @@
+#pragma once
+
+#include "crc.h"
+#include "format.h"
+#include "parser.h"
+
+#include <stddef.h>
+
+#include <EEPROM.h>
+#include <Print.h>
+
+namespace gservo {
+
+template <int N>
+struct Set {
+    float homingPullOff_;
+    FVec<N> speed_;
+    FVec<N> accel_;
+    FVec<N> zero_;
+    FVec<N> p_;
+    FVec<N> i_;
+    FVec<N> d_;
+    FVec<N> punch_;
+    FVec<N> torque_;
+    float dirInvert_;
+    float reportMoving_;
+    float reportIdle_;
+    float telemetry_;
+    float profile_;
+    float trackLead_;
+    float trackAlpha_;
+    float trackBeta_;
+    float trackTimeout_;
+    float arriveTol_;
+    float arriveSpeed_;
+    float arriveReads_;
+    float pollMoving_;
+    float pollIdle_;
+    float scanOverlap_;
+    float scanSettle_;
+    float shutterPulse_;
+    float scanExpose_;
+    float shutterPin_;
+    FVec<N> fov_;
+};
+
+// Defined by the sketch for its number of axes.
+template <int N>
+Set<N> defSettings();
+
+// Defaults for MX servos which the host builds take as defSettings, the sketch keeps its own
+// commented list. Fields are set by name, so one appended to Set does not shift the others.
+template <int N>
+Set<N> baseSettings()
+{
+    using V = FVec<N>;
+    Set<N> s{};
+    s.homingPullOff_ = 0.f;
+    s.speed_ = V::ofConst(15000.f);
+    s.accel_ = V::ofConst(2000.f);
+    s.zero_ = V::ofConst(0.f);
+    s.p_ = V::ofConst(0.05f);
+    s.i_ = V::ofConst(0.f);
+    s.d_ = V::ofConst(0.01f);
+    s.punch_ = V::ofConst(0.f);
+    s.torque_ = V::ofConst(1.f);
+    s.dirInvert_ = 0;
+    s.reportMoving_ = 0;
+    s.reportIdle_ = 0;
+    s.telemetry_ = 0;
+    s.profile_ = 0;
+    s.trackLead_ = 30;
+    s.trackAlpha_ = 0.5f;
+    s.trackBeta_ = 0.1f;
+    s.trackTimeout_ = 200;
+    s.arriveTol_ = 0.1f;
+    s.arriveSpeed_ = 50;
+    s.arriveReads_ = 2;
+    s.pollMoving_ = 0;
+    s.pollIdle_ = 500;
+    s.scanOverlap_ = 0.3f;
+    s.scanSettle_ = 200;
+    s.shutterPulse_ = 100;
+    s.scanExpose_ = 500;
+    s.shutterPin_ = 0;
+    s.fov_ = V::ofConst(30.f);
+    return s;
+}
+
+#ifndef GSERVO_PROFILES
+#define GSERVO_PROFILES 4
+#endif
+
+// EEPROM of the board, E2END is its last address from the AVR headers.
+constexpr size_t eepromBytes = E2END + 1ul;
+
+// Setting number with its place in Set, accepted range and whether it belongs to a profile.
+struct RegItem {
+    uint16_t snum;
+    uint8_t idx;
+    float minV;
+    float maxV;
+    bool tuning;
+};
+
+namespace reg {
+constexpr uint8_t idx(size_t offset) { return static_cast<uint8_t>(offset / sizeof(float)); }
+
+constexpr RegItem axisItem(const RegItem& g, int axis)
+{
+    return {static_cast<uint16_t>(g.snum + axis),
+            static_cast<uint8_t>(g.idx + axis),
+            g.minV,
+            g.maxV,
+            g.tuning};
+}
+
+template <int N>
+struct Layout {
+    using S = Set<N>;
+
+    // Settings with single value, in ascending order.
+    static constexpr RegItem scalars[]{
+            {3, idx(offsetof(S, dirInvert_)), 0.f, (1u << N) - 1.f, false},
+            {5, idx(offsetof(S, profile_)), 0.f, GSERVO_PROFILES - 1.f, false},
+            {27, idx(offsetof(S, homingPullOff_)), -360.f, 360.f, false},
+            {40, idx(offsetof(S, reportMoving_)), 0.f, 60000.f, false},
+            {41, idx(offsetof(S, reportIdle_)), 0.f, 60000.f, false},
+            {42, idx(offsetof(S, telemetry_)), 0.f, 60000.f, false},
+            {43, idx(offsetof(S, trackLead_)), 0.f, 1000.f, false},
+            {44, idx(offsetof(S, trackAlpha_)), 0.f, 1.f, false},
+            {45, idx(offsetof(S, trackBeta_)), 0.f, 2.f, false},
+            {46, idx(offsetof(S, trackTimeout_)), 0.f, 60000.f, false},
+            {47, idx(offsetof(S, arriveTol_)), 0.f, 360.f, false},
+            {48, idx(offsetof(S, arriveSpeed_)), 0.f, 360000.f, false},
+            {49, idx(offsetof(S, arriveReads_)), 1.f, 100.f, false},
+            {50, idx(offsetof(S, pollMoving_)), 0.f, 60000.f, false},
+            {51, idx(offsetof(S, pollIdle_)), 0.f, 60000.f, false},
+            {52, idx(offsetof(S, scanOverlap_)), 0.f, 0.9f, false},
+            {53, idx(offsetof(S, scanSettle_)), 0.f, 60000.f, false},
+            {54, idx(offsetof(S, shutterPulse_)), 0.f, 60000.f, false},
+            {55, idx(offsetof(S, scanExpose_)), 0.f, 60000.f, false},
+            {56, idx(offsetof(S, shutterPin_)), 0.f, 255.f, false},
+    };
+
+    // Settings with value per axis, numbered base + axis, in ascending order.
+    static constexpr RegItem axes[]{
+            {110, idx(offsetof(S, speed_)), 0.f, 360000.f, true},
+            {120, idx(offsetof(S, accel_)), 0.f, 2200.f, true},
+            {140, idx(offsetof(S, zero_)), -360.f, 360.f, false},
+            {160, idx(offsetof(S, fov_)), 0.f, 360.f, false},
+            {200, idx(offsetof(S, p_)), 0.f, 1.f, true},
+            {210, idx(offsetof(S, i_)), 0.f, 1.f, true},
+            {220, idx(offsetof(S, d_)), 0.f, 1.f, true},
+            {230, idx(offsetof(S, punch_)), 0.f, 1.f, true},
+            {240, idx(offsetof(S, torque_)), 0.f, 1.f, true},
+    };
+
+    static constexpr int scalarsLen = sizeof(scalars) / sizeof(scalars[0]);
+    static constexpr int axesLen = sizeof(axes) / sizeof(axes[0]);
+    static constexpr int len = scalarsLen + axesLen * N;
+
+    static constexpr RegItem item(int k)
+    {
+        return k < scalarsLen ? scalars[k]
+                              : axisItem(axes[(k - scalarsLen) / N], (k - scalarsLen) % N);
+    }
+
+    static constexpr bool sorted(int k = 1)
+    {
+        return k >= len || (item(k - 1).snum < item(k).snum && sorted(k + 1));
+    }
+
+    static constexpr int tuningLen(int k = 0)
+    {
+        return k >= len ? 0 : item(k).tuning + tuningLen(k + 1);
+    }
+};
+
+template <int N>
+constexpr RegItem Layout<N>::scalars[];
+
+template <int N>
+constexpr RegItem Layout<N>::axes[];
+
+template <int... Is>
+struct Seq {};
+
+template <int N, int... Is>
+struct MakeSeq : MakeSeq<N - 1, N - 1, Is...> {};
+
+template <int... Is>
+struct MakeSeq<0, Is...> {
+    using type = Seq<Is...>;
+};
+
+template <int N, typename S>
+struct Table;
+
+// Generated once at compile time and kept in flash.
+template <int N, int... Is>
+struct Table<N, Seq<Is...>> {
+    static const RegItem items[sizeof...(Is)];
+};
+
+template <int N, int... Is>
+const RegItem Table<N, Seq<Is...>>::items[sizeof...(Is)] PROGMEM = {Layout<N>::item(Is)...};
+
+template <int N>
+using Items = Table<N, typename MakeSeq<Layout<N>::len>::type>;
+} // namespace reg
+
+// Access to Set fields by setting number.
+template <int N>
+class Reg {
+    using L = reg::Layout<N>;
+
+    static_assert(sizeof(Set<N>) % sizeof(float) == 0, "Set should consist of floats");
+    static_assert(L::axes[0].snum + N <= L::axes[1].snum, "too many axes for numbering");
+    static_assert(L::sorted(), "settings should be sorted by number");
+
+public:
+    enum class Res : uint8_t {
+        Ok,
+        Unknown,
+        OutOfRange,
+    };
+
+    explicit Reg(Set<N>* set) : set_(set) {}
+
+    float get(unsigned s) const
+    {
+        const int i = find(s);
+        return i < 0 ? NAN : at(item(i));
+    }
+
+    Res set(unsigned s, float val)
+    {
+        const int i = find(s);
+        if (i < 0) {
+            return Res::Unknown;
+        }
+        const auto it = item(i);
+        if (!(val >= it.minV && val <= it.maxV)) {
+            return Res::OutOfRange;
+        }
+        at(it) = val;
+        return Res::Ok;
+    }
+
+    // Takes defaults for settings which were never stored or are out of range, e.g. added after
+    // an update. Returns whether any setting was replaced.
+    bool fillInvalid(const Set<N>& def)
+    {
+        bool any = false;
+        for (int i = 0; i < L::len; ++i) {
+            const auto it = item(i);
+            const float v = at(it);
+            if (!(v >= it.minV && v <= it.maxV)) {
+                at(it) = reinterpret_cast<const float*>(&def)[it.idx];
+                any = true;
+            }
+        }
+        return any;
+    }
+
+    // Copies settings which belong to a profile into packed array of L::tuningLen() floats.
+    void packTuning(float* dst) const
+    {
+        for (int i = 0; i < L::len; ++i) {
+            const auto it = item(i);
+            if (it.tuning) {
+                *dst++ = at(it);
+            }
+        }
+    }
+
+    void unpackTuning(const float* src)
+    {
+        for (int i = 0; i < L::len; ++i) {
+            const auto it = item(i);
+            if (it.tuning) {
+                at(it) = *src++;
+            }
+        }
+    }
+
+    static bool isTuning(unsigned s)
+    {
+        const int i = find(s);
+        return i >= 0 && item(i).tuning;
+    }
+
+    // Prints settings starting from `from` while each line surely fits into `room` bytes.
+    // Returns index to continue from or -1 when all settings were printed.
+    int print(Print& p, int from, size_t room) const
+    {
+        for (; from < L::len && room >= lineMax; ++from, room -= lineMax) {
+            const auto it = item(from);
+            StrBuf<lineMax> line;
+            line.add('$').add(static_cast<unsigned>(it.snum)).add('=').fixed(at(it)).add('\n');
+            p.write(line.data(), line.size());
+        }
+        return from < L::len ? from : -1;
+    }
+
+private:
+    static constexpr size_t lineMax = 24;
+
+    static RegItem item(int i)
+    {
+        RegItem it;
+        memcpy_P(&it, &reg::Items<N>::items[i], sizeof(it));
+        return it;
+    }
+
+    static int find(unsigned s)
+    {
+        int lo = 0;
+        int hi = L::len - 1;
+        while (lo <= hi) {
+            const int mid = (lo + hi) / 2;
+            const unsigned m = item(mid).snum;
+            if (m == s) {
+                return mid;
+            }
+            if (m < s) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid - 1;
+            }
+        }
+        return -1;
+    }
+
+    float& at(const RegItem& it) const { return reinterpret_cast<float*>(set_)[it.idx]; }
+
+    Set<N>* set_;
+};
+
+// Settings record in EEPROM: header with layout version, axis count, length and CRC, then Set.
+// Fields are only appended to Set, a record of an older version keeps its stored prefix and
+// takes defaults for the rest. Bump version when a field changes meaning or place.
+template <int N>
+class SetStore {
+public:
+    enum class Res : uint8_t {
+        Ok,
+        Migrated,
+        Defaults,
+    };
+
+    static constexpr uint16_t magic = 0x5347;
+    static constexpr uint8_t version = 1;
+
+    struct Header {
+        uint16_t magic;
+        uint8_t version;
+        uint8_t axes;
+        uint16_t len;
+        uint16_t crc;
+    };
+
+    // EEPROM taken by the record at its start.
+    static constexpr size_t bytes() { return sizeof(Header) + sizeof(Set<N>); }
+
+    static_assert(sizeof(Header) + sizeof(Set<N>) <= eepromBytes, "settings do not fit EEPROM");
+
+    static Res load(Set<N>& set)
+    {
+        const auto def = defSettings<N>();
+        set = def;
+        Header h{};
+        EEPROM.get(0, h);
+        Res res = Res::Defaults;
+        if (h.magic == magic && h.axes == N && h.version <= version && h.len > 0) {
+            const auto len = h.len < sizeof(set) ? h.len : sizeof(set);
+            if (read(set, len) == h.crc) {
+                res = h.version == version && h.len == sizeof(set) ? Res::Ok : Res::Migrated;
+            }
+            else {
+                set = def;
+            }
+        }
+        else if (h.magic != magic) {
+            // Plain Set stored at the start by firmware before the header was introduced.
+            EEPROM.get(0, set);
+            res = Res::Migrated;
+        }
+        if (Reg<N>{&set}.fillInvalid(def) && res == Res::Ok) {
+            res = Res::Migrated;
+        }
+        return res;
+    }
+
+    static void save(const Set<N>& set)
+    {
+        const auto p = reinterpret_cast<const uint8_t*>(&set);
+        const Header h{magic, version, N, sizeof(set), crc16(0, p, sizeof(set))};
+        // EEPROM.put updates only changed cells.
+        EEPROM.put(sizeof(Header), set);
+        EEPROM.put(0, h);
+    }
+
+private:
+    static uint16_t read(Set<N>& set, size_t len)
+    {
+        auto p = reinterpret_cast<uint8_t*>(&set);
+        for (size_t i = 0; i < len; ++i) {
+            p[i] = EEPROM.read(static_cast<int>(sizeof(Header) + i));
+        }
+        return crc16(0, p, len);
+    }
+};
+
+// Tuning settings of numbered profiles. Slots are kept at the end of EEPROM, so they stay in
+// place when the main record grows. With many axes fewer than GSERVO_PROFILES slots may fit
+// above the main record, the rest are not available.
+template <int N>
+class ProfileStore {
+    struct Slot {
+        uint16_t crc;
+        float vals[reg::Layout<N>::tuningLen()];
+    };
+
+    static constexpr int fit =
+            static_cast<int>((eepromBytes - SetStore<N>::bytes()) / sizeof(Slot));
+    static_assert(fit > 0, "no profile fits EEPROM next to the settings");
+
+public:
+    static constexpr int count = GSERVO_PROFILES < fit ? GSERVO_PROFILES : fit;
+
+    // Takes tuning settings of profile k into set, false when the slot was never saved.
+    static bool load(int k, Set<N>& set)
+    {
+        if (k < 0 || k >= count) {
+            return false;
+        }
+        Slot slot{};
+        EEPROM.get(addr(k), slot);
+        if (slot.crc != crc(slot)) {
+            return false;
+        }
+        Reg<N>{&set}.unpackTuning(slot.vals);
+        return true;
+    }
+
+    static void save(int k, const Set<N>& set)
+    {
+        if (k < 0 || k >= count) {
+            return;
+        }
+        Slot slot{};
+        Reg<N>{const_cast<Set<N>*>(&set)}.packTuning(slot.vals);
+        slot.crc = crc(slot);
+        EEPROM.put(addr(k), slot);
+    }
+
+    // EEPROM taken by the slots at its end.
+    static constexpr size_t bytes() { return count * sizeof(Slot); }
+
+private:
+    static uint16_t crc(const Slot& slot)
+    {
+        // Seeded with layout so slots of a build with other axes or fields are not taken.
+        constexpr uint16_t seed = N << 8 | reg::Layout<N>::tuningLen();
+        return crc16(seed, reinterpret_cast<const uint8_t*>(slot.vals), sizeof(slot.vals));
+    }
+
+    static int addr(int k)
+    {
+        return static_cast<int>(EEPROM.length() - (count - k) * sizeof(Slot));
+    }
+};
+
+template <int N>
+constexpr int ProfileStore<N>::count;
+
+#ifndef GSERVO_PROGRAMS
+#define GSERVO_PROGRAMS 4
+#endif
+
+#ifndef GSERVO_PROGRAM_BYTES
+#define GSERVO_PROGRAM_BYTES 96
+#endif
+
+// Numbered programs in tokens, see program.h. Slots are kept right below the profile slots, a
+// program is written while its lines arrive and becomes valid with its header at the end. Only
+// the slots which fit between the main record and the profiles are available.
+template <int N>
+class ProgramStore {
+    struct Header {
+        uint16_t len;
+        uint16_t crc;
+    };
+
+    static constexpr size_t slot = sizeof(Header) + GSERVO_PROGRAM_BYTES;
+    static constexpr int fit = static_cast<int>(
+            (eepromBytes - SetStore<N>::bytes() - ProfileStore<N>::bytes()) / slot);
+
+public:
+    static constexpr int count = GSERVO_PROGRAMS < fit ? GSERVO_PROGRAMS : fit;
+    static constexpr int capacity = GSERVO_PROGRAM_BYTES;
+
+    static_assert(SetStore<N>::bytes() + ProfileStore<N>::bytes() + count * slot <= eepromBytes,
+                  "EEPROM regions overlap");
+
+    // Length of program k, 0 when it was never stored or is damaged.
+    static int length(int k)
+    {
+        Header h{};
+        EEPROM.get(addr(k), h);
+        if (h.len == 0 || h.len > capacity || h.crc != crc(k, h.len)) {
+            return 0;
+        }
+        return h.len;
+    }
+
+    static uint8_t byte(int k, int i) { return EEPROM.read(addr(k) + sizeof(Header) + i); }
+
+    // Program k is invalid until end() is called.
+    static void begin(int k) { EEPROM.put(addr(k), Header{0, 0}); }
+
+    static void write(int k, int i, uint8_t b) { EEPROM.update(addr(k) + sizeof(Header) + i, b); }
+
+    static void end(int k, int len)
+    {
+        const auto n = static_cast<uint16_t>(len);
+        EEPROM.put(addr(k), Header{n, crc(k, n)});
+    }
+
+private:
+    static uint16_t crc(int k, uint16_t len)
+    {
+        uint16_t c = 0;
+        for (int i = 0; i < len; ++i) {
+            const uint8_t b = byte(k, i);
+            c = crc16(c, &b, 1);
+        }
+        return c;
+    }
+
+    static int addr(int k)
+    {
+        return static_cast<int>(EEPROM.length() - ProfileStore<N>::bytes() - (count - k) * slot);
+    }
+};
+
+template <int N>
+constexpr int ProgramStore<N>::count;
+
+template <int N>
+constexpr int ProgramStore<N>::capacity;
+
+} // namespace gservo
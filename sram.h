@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// RAM the sketch may spend on its static objects, checked at compile time. The ATmega328P has
+// 2048 bytes, the rest is left to the core serial buffers and the stack.
+#ifndef GSERVO_RAM_BUDGET
+#define GSERVO_RAM_BUDGET 1200
+#endif
+
+#if defined(__AVR__)
+extern char __heap_start;
+extern char* __brkval;
+#endif
+
+namespace gservo {
+namespace sram {
+
+#if defined(__AVR__)
+constexpr uint8_t paint = 0xC5;
+
+// End of the heap, which is the start of it while nothing was allocated.
+inline char* heapEnd() { return __brkval ? __brkval : &__heap_start; }
+
+// Fills RAM between the heap and the stack with a pattern, lowestFree() then tells how much of it
+// the stack never reached. Call it first thing in setup().
+__attribute__((noinline)) inline void paintStack()
+{
+    char top;
+    // Margin for the frame of this function.
+    for (char* p = heapEnd(); p < &top - 16; ++p) {
+        *p = static_cast<char>(paint);
+    }
+}
+
+// Bytes between the heap and the stack now.
+__attribute__((noinline)) inline size_t freeStack()
+{
+    char top;
+    return static_cast<size_t>(&top - heapEnd());
+}
+
+// Bytes between the heap and the deepest stack since paintStack().
+inline size_t lowestFree()
+{
+    const char* p = heapEnd();
+    while (static_cast<uint8_t>(*p) == paint) {
+        ++p;
+    }
+    return static_cast<size_t>(p - heapEnd());
+}
+#else
+// Not measured off AVR.
+inline void paintStack() {}
+
+inline size_t freeStack() { return 0; }
+
+inline size_t lowestFree() { return 0; }
+#endif
+
+} // namespace sram
+} // namespace gservo
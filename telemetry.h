@@ -0,0 +1,113 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stddef.h>
+#include <string.h>
+
+namespace gservo {
+
+// Present values of one servo as read from its control table.
+struct ServoState {
+    int16_t pos;
+    int16_t speed;
+    int16_t load;
+    uint8_t voltage;
+    uint8_t temp;
+};
+
+// Binary telemetry frames:
+//   0xA5, len, type, timestamp, axes..., checksum
+// where len counts bytes from type to the last axis byte and checksum is inverted low byte of the
+// sum of bytes from len to the last axis byte, as in Dynamixel packets.
+// Key frame 'K' has 4 byte little endian timestamp in ms and per axis pos, speed, load as int16
+// and voltage, temperature as uint8.
+// Delta frame 'D' has varint of ms since previous frame and per axis the same five fields as
+// zigzag varint differences from previous frame.
+template <int N>
+class Telemetry {
+public:
+    enum : uint8_t {
+        sync = 0xA5,
+        keyFrame = 'K',
+        deltaFrame = 'D',
+    };
+
+    static constexpr uint8_t keyEvery = 16;
+    static constexpr size_t frameMax = 3 + 5 + N * 13 + 1;
+
+    // Encodes next frame into buf of frameMax bytes, returns its length.
+    size_t encode(uint8_t* buf, unsigned long ms, const ServoState* st)
+    {
+        size_t n = 3;
+        if (sinceKey_ >= keyEvery) {
+            buf[2] = keyFrame;
+            for (int i = 0; i < 4; ++i) {
+                buf[n++] = static_cast<uint8_t>(ms >> (8 * i));
+            }
+            for (int i = 0; i < N; ++i) {
+                n = put16(buf, n, st[i].pos);
+                n = put16(buf, n, st[i].speed);
+                n = put16(buf, n, st[i].load);
+                buf[n++] = st[i].voltage;
+                buf[n++] = st[i].temp;
+            }
+            sinceKey_ = 0;
+        }
+        else {
+            buf[2] = deltaFrame;
+            n = varint(buf, n, ms - prevMs_);
+            for (int i = 0; i < N; ++i) {
+                n = zigzag(buf, n, st[i].pos - prev_[i].pos);
+                n = zigzag(buf, n, st[i].speed - prev_[i].speed);
+                n = zigzag(buf, n, st[i].load - prev_[i].load);
+                n = zigzag(buf, n, st[i].voltage - prev_[i].voltage);
+                n = zigzag(buf, n, st[i].temp - prev_[i].temp);
+            }
+        }
+        ++sinceKey_;
+        prevMs_ = ms;
+        memcpy(prev_, st, sizeof(prev_));
+        buf[0] = sync;
+        buf[1] = static_cast<uint8_t>(n - 2);
+        uint8_t sum = 0;
+        for (size_t i = 1; i < n; ++i) {
+            sum += buf[i];
+        }
+        buf[n++] = static_cast<uint8_t>(~sum);
+        return n;
+    }
+
+    // Frame was not delivered, so the next one should not be a delta to it.
+    void lost() { sinceKey_ = keyEvery; }
+
+private:
+    static size_t put16(uint8_t* buf, size_t n, int16_t v)
+    {
+        buf[n++] = static_cast<uint8_t>(v);
+        buf[n++] = static_cast<uint8_t>(static_cast<uint16_t>(v) >> 8);
+        return n;
+    }
+
+    static size_t varint(uint8_t* buf, size_t n, unsigned long v)
+    {
+        while (v >= 0x80) {
+            buf[n++] = static_cast<uint8_t>(v | 0x80);
+            v >>= 7;
+        }
+        buf[n++] = static_cast<uint8_t>(v);
+        return n;
+    }
+
+    static size_t zigzag(uint8_t* buf, size_t n, long v)
+    {
+        const auto u = static_cast<unsigned long>(v) << 1;
+        return varint(buf, n, v < 0 ? ~u : u);
+    }
+
+    ServoState prev_[N]{};
+    unsigned long prevMs_{};
+    uint8_t sinceKey_{keyEvery};
+};
+
+} // namespace gservo
@@ -1,15 +1,51 @@
+#include "../crc.h"
+#include "../daemon/FdStream.h"
+#include "../daemon/Server.h"
+#include "../daemon/Tty.h"
+#include "../format.h"
+#include "../gservo.h"
+#include "../models.h"
 #include "../parser.h"
+#include "../profiler.h"
+#include "../scheduler.h"
+#include "../telemetry.h"
 
 #include "catch.hpp"
 
+#include <DynamixelSim.h>
+#include <EEPROM.h>
+#include <Stream.h>
+
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace gservo {
+template <>
+Set<2> defSettings<2>()
+{
+    auto s = baseSettings<2>();
+    s.reportMoving_ = 200;
+    return s;
+}
+
+template <>
+Set<6> defSettings<6>()
+{
+    return baseSettings<6>();
+}
+
 namespace tests {
 using namespace Catch;
 
-class StrCb : public Callbacks {
+template <int N>
+class StrCb : public Callbacks<N> {
 public:
     StrCb() { ss_.setf(std::ios_base::boolalpha); }
 
@@ -27,22 +63,71 @@ public:
 
     void setSpeed(float val) override { ss_ << "sp " << val << ";"; }
 
-    void move(const FVec& p, bool report) override
+    void selectProfile(unsigned n) override { ss_ << "prof " << n << ";"; }
+
+    void move(const FVec<N>& p, bool report) override
     {
         ss_ << "mv ";
-        for (int i = 0; i < COORDS; ++i) {
+        for (int i = 0; i < N; ++i) {
             ss_ << p[i] << ", " << p.has(i) << ", ";
         }
         ss_ << report << ";";
     }
 
+    void track(unsigned long ts, const FVec<N>& p) override
+    {
+        ss_ << "track " << ts;
+        for (int i = 0; i < N; ++i) {
+            ss_ << ", " << p[i];
+        }
+        ss_ << ";";
+    }
+
     void reportCurrentPos() override { ss_ << "curr pos;"; }
 
+    void dwell(unsigned long ms) override { ss_ << "dwell " << ms << ";"; }
+
     void setSetting(unsigned s, float val, bool hasVal) override
     {
         ss_ << "s " << s << ", " << val << ", " << hasVal << ";";
     }
 
+    bool beginProgram(unsigned k) override
+    {
+        ss_ << "sub " << k << ";";
+        return true;
+    }
+
+    void programLine(const uint8_t* tokens, int len) override
+    {
+        ss_ << "line " << len << ";";
+        (void)tokens;
+    }
+
+    void endProgram() override { ss_ << "endsub;"; }
+
+    void callProgram(unsigned k, unsigned count, const float* params, int n) override
+    {
+        ss_ << "call " << k << ", " << count;
+        for (int i = 0; i < n; ++i) {
+            ss_ << ", " << params[i];
+        }
+        ss_ << ";";
+    }
+
+    void listProgram(unsigned k) override { ss_ << "list " << k << ";"; }
+
+    void scan(const FVec<N>& span, unsigned pattern) override
+    {
+        ss_ << "scan";
+        for (int i = 0; i < N; ++i) {
+            ss_ << " " << span[i];
+        }
+        ss_ << ", " << pattern << ";";
+    }
+
+    void showSetting(unsigned s) override { ss_ << "s " << s << ";"; }
+
     void showSettings() override { ss_ << "s show;"; }
 
     void servoId(unsigned cmd, int id, int val) override
@@ -58,10 +143,11 @@ private:
     std::stringstream ss_;
 };
 
+template <int N = 2>
 std::string parse(const std::string& str)
 {
-    StrCb cb;
-    Parser p{&cb};
+    StrCb<N> cb;
+    Parser<N> p{&cb};
     p.parse(str.c_str(), static_cast<int>(str.length()));
     return cb.str();
 }
@@ -98,6 +184,1065 @@ TEST_CASE("Parser")
                Equals("g 1;sp 1000;mv 0, true, nan, false, false;eol;"
                       "g 1;sp 10;mv nan, false, 20, true, false;eol;"
                       "g 1;sp 1;mv 100, true, 200, true, true;eol;"));
+    CHECK_THAT(parse("$5\n"), Equals("s 5;eol;"));
+    CHECK_THAT(parse("t1\n"), Equals("prof 1;eol;"));
+    CHECK_THAT(parse("T2 x1\n"), Equals("prof 2;mv 1, true, nan, false, false;eol;"));
+    CHECK_THAT(parse("g0 x1 f5 t0 m2\n"),
+               Equals("g 0;prof 0;sp 5;mv 1, true, nan, false, true;eol;"));
+    CHECK_THAT(parse("t\n"), Equals("err expect profile number;err expect move; '\n' at 1;eol;"));
+    CHECK_THAT(parse("g4 p1500\n"), Equals("dwell 1500;eol;"));
+    CHECK_THAT(parse("M400\n"), Equals("dwell 0;eol;"));
+    CHECK_THAT(parse("g4\n"), Equals("err expect dwell time; '\n' at 2;eol;"));
+    CHECK_THAT(parse("m2\n"), Equals("err expect m400; '\n' at 2;eol;"));
+    CHECK_THAT(parse("@4000000000 x1 y-2\n"), Equals("track 4000000000, 1, -2;eol;"));
+    CHECK_THAT(parse("@12 y3\n"), Equals("track 12, nan, 3;eol;"));
+    CHECK_THAT(parse("@ x1\n"), Equals("err expect timestamp; 'x' at 2;eol;"));
+    CHECK_THAT(parse("@12\n"), Equals("err expect position; '\n' at 3;eol;"));
+    CHECK_THAT(parse("o1 sub\nx#1 Y2\n?\no2 call\no1 endsub\nx1\n"),
+               Equals("sub 1;eol;line 5;eol;curr pos;eol;err expect endsub; 'c' at 19;eol;"
+                      "endsub;eol;mv 1, true, nan, false, false;eol;"));
+    CHECK_THAT(parse("o3 call [10] [-2.5] l4\n"), Equals("call 3, 4, 10, -2.5;eol;"));
+    CHECK_THAT(parse("O0 LIST\n"), Equals("list 0;eol;"));
+    CHECK_THAT(parse("o1 call l0\n"), Equals("err expect loop count; '\n' at 10;eol;"));
+    CHECK_THAT(parse("o1 call l65535\n"), Equals("call 1, 65535;eol;"));
+    CHECK_THAT(parse("o1 call l65536\n"), Equals("err expect loop count; '\n' at 14;eol;"));
+    CHECK_THAT(parse("o1 call l99999999999\n"), Equals("err expect loop count; '\n' at 20;eol;"));
+    CHECK_THAT(parse("o1 sub\no2 endsub\no1 endsub\n"),
+               Equals("sub 1;eol;err endsub of another program; '\n' at 16;eol;endsub;eol;"));
+    CHECK_THAT(parse("o1 subx\n"), Equals("err expect sub, call or list; 's' at 3;eol;"));
+    CHECK_THAT(parse("o1 call [1] [2] [3] [4] [5]\n"),
+               Equals("err expect up to 4 parameters in brackets; '5' at 25;eol;"));
+    CHECK_THAT(parse("scan x120 y40\n"), Equals("scan 120 40, 0;eol;"));
+    CHECK_THAT(parse("SCAN y30 P1\n"), Equals("scan nan 30, 1;eol;"));
+    CHECK_THAT(parse("scan p1\n"), Equals("err expect scan span; 'p' at 5;eol;"));
+    CHECK_THAT(parse("scan x10 p\n"), Equals("err expect scan pattern; '\n' at 10;eol;"));
+    CHECK_THAT(parse("o1 sub\nx#5\n"),
+               Equals("sub 1;eol;err bad program line; 'x' at 7;eol;"));
+}
+
+TEST_CASE("Parser axes")
+{
+    CHECK_THAT(parse<1>("x1 y2\n"),
+               Equals("mv 1, true, false;err expect end of line; 'y' at 3;eol;"));
+    CHECK_THAT(parse<4>("g1 a4 x1 z3\n"),
+               Equals("g 1;mv 1, true, nan, false, 3, true, 4, true, false;eol;"));
+    CHECK_THAT(parse<4>("b1\n"), Equals("err expect end of line; 'b' at 0;eol;"));
+    CHECK_THAT(parse<6>("c-1 B.5\n"),
+               Equals("mv nan, false, nan, false, nan, false, nan, false, 0.5, true, -1, true, "
+                      "false;eol;"));
+}
+
+std::string fixed(float v, uint8_t decimals = 2)
+{
+    char buf[fixedMax];
+    return std::string(buf, formatFixed(buf, v, decimals));
+}
+
+TEST_CASE("Format")
+{
+    CHECK_THAT(fixed(0), Equals("0.00"));
+    CHECK_THAT(fixed(12.345f), Equals("12.35"));
+    CHECK_THAT(fixed(-12.344f), Equals("-12.34"));
+    CHECK_THAT(fixed(-0.001f), Equals("0.00"));
+    CHECK_THAT(fixed(0.05f), Equals("0.05"));
+    CHECK_THAT(fixed(15000), Equals("15000.00"));
+    CHECK_THAT(fixed(7.6f, 0), Equals("8"));
+    CHECK_THAT(fixed(0.0005f, 3), Equals("0.001"));
+    CHECK_THAT(fixed(1.5f, 9), Equals("1.5000"));
+    CHECK_THAT(fixed(NAN), Equals("nan"));
+    CHECK_THAT(fixed(1e9f), Equals("ovf"));
+
+    StrBuf<32> b;
+    b.add("<Idle|MPos:").fixed(FVec<2>{1.f, -2.5f}).add('>');
+    CHECK_THAT(b.c_str(), Equals("<Idle|MPos:1.00,-2.50>"));
+    const auto mark = b.size();
+    b.add(-42).add(' ').add(7u);
+    CHECK_THAT(b.c_str(), Equals("<Idle|MPos:1.00,-2.50>-42 7"));
+    b.truncate(mark);
+    CHECK_THAT(b.c_str(), Equals("<Idle|MPos:1.00,-2.50>"));
+
+    StrBuf<4> small;
+    small.add("12345");
+    CHECK(small.overflow());
+    CHECK(small.size() == 4);
+}
+
+long unzigzag(unsigned long v)
+{
+    return v & 1 ? ~static_cast<long>(v >> 1) : static_cast<long>(v >> 1);
+}
+
+unsigned long varint(const uint8_t*& p)
+{
+    unsigned long v = 0;
+    for (int shift = 0;; shift += 7) {
+        v |= static_cast<unsigned long>(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) {
+            return v;
+        }
+    }
+}
+
+TEST_CASE("JoinPrint")
+{
+    host::Terminal fast{0, 256};
+    host::Terminal stuck{0, 0};
+    OutQueue a{&fast};
+    OutQueue b{&stuck};
+    JoinPrint<2> join{&a, &b};
+    host::Clock::advance(1000000);
+    join.drain();
+    CHECK(join.room() == GSERVO_OUT_BULK);
+
+    // A sink which takes nothing for a while is not waited for, its queue drops the rest.
+    const std::string line(100, 'x');
+    CHECK(join.print(line.c_str()) == line.size());
+    join.drain();
+    host::Clock::advance((GSERVO_OUT_STALL_MS + 1) * 1000ul);
+    join.drain();
+    CHECK(b.stalled());
+    CHECK(join.room() == GSERVO_OUT_BULK);
+    CHECK(join.print(line.c_str()) == line.size());
+    join.drain();
+    CHECK(fast.take() == line + line);
+    CHECK(b.dropped() == 2 * line.size() - GSERVO_OUT_BULK);
+
+    // With every sink stalled long outputs still go on.
+    a.print(line.c_str());
+    host::Clock::advance((GSERVO_OUT_STALL_MS + 1) * 1000ul);
+    CHECK(a.stalled());
+    CHECK(join.room() == GSERVO_OUT_BULK);
+
+    // A queue attached again after an earlier place was freed gets its text once.
+    host::Terminal t1{0, 256};
+    host::Terminal t2{0, 256};
+    OutQueue q1{&t1};
+    OutQueue q2{&t2};
+    JoinPrint<2> subs;
+    CHECK(subs.attach(&q1));
+    CHECK(subs.attach(&q2));
+    subs.detach(&q1);
+    CHECK(subs.attach(&q2));
+    subs.print("a\n");
+    subs.drain();
+    CHECK(t2.take() == "a\n");
+    CHECK(subs.attach(&q1));
+    CHECK_FALSE(subs.attach(&a));
+    subs.print("b\n");
+    subs.drain();
+    CHECK(t1.take() == "b\n");
+    CHECK(t2.take() == "b\n");
 }
+
+TEST_CASE("Telemetry")
+{
+    constexpr int N = 2;
+    Telemetry<N> t;
+    ServoState st[N]{{2048, -10, 300, 120, 40}, {100, 0, -5, 121, 41}};
+    uint8_t f[Telemetry<N>::frameMax];
+
+    auto len = t.encode(f, 1000, st);
+    REQUIRE(len == 3u + 4u + N * 8u + 1u);
+    CHECK(f[0] == Telemetry<N>::sync);
+    CHECK(f[1] == len - 3);
+    CHECK(f[2] == Telemetry<N>::keyFrame);
+    CHECK((f[3] | f[4] << 8 | f[5] << 16 | f[6] << 24) == 1000);
+    CHECK(static_cast<int16_t>(f[7] | f[8] << 8) == 2048);
+    CHECK(static_cast<int16_t>(f[9] | f[10] << 8) == -10);
+    uint8_t sum = 0;
+    for (size_t i = 1; i < len; ++i) {
+        sum += f[i];
+    }
+    CHECK(sum == 0xFF);
+
+    st[0].pos = 2000;
+    st[1].load = 5;
+    len = t.encode(f, 1020, st);
+    REQUIRE(f[2] == Telemetry<N>::deltaFrame);
+    CHECK(len == 3u + 1u + N * 5u + 1u);
+    const uint8_t* p = f + 3;
+    CHECK(varint(p) == 20);
+    std::vector<long> d;
+    for (int i = 0; i < N * 5; ++i) {
+        d.push_back(unzigzag(varint(p)));
+    }
+    CHECK(d == std::vector<long>{-48, 0, 0, 0, 0, 0, 0, 10, 0, 0});
+
+    t.lost();
+    CHECK(t.encode(f, 1040, st) == 3u + 4u + N * 8u + 1u);
+    CHECK(f[2] == Telemetry<N>::keyFrame);
+}
+
+TEST_CASE("Models")
+{
+    using Mixed = Models<Ax, Mx, Ax>;
+    static_assert(Mixed::count == 3, "");
+    static_assert(Mixed::anyAcc && Mixed::anyPid, "");
+    static_assert(!Mixed::sameLimits, "");
+    static_assert(Mixed::regAcc == 0x49 && Mixed::regPresent == 0x24, "");
+    CHECK_FALSE(Mixed::hasAcc[0]);
+    CHECK(Mixed::hasPid[1]);
+    CHECK(Mixed::unitDeg[2] == Approx(300.f / 1023.f));
+    CHECK(Mixed::maxPos[1] == 0xFFF);
+
+    using AllAx = Same<Ax, 4>::type;
+    static_assert(AllAx::count == 4, "");
+    static_assert(!AllAx::anyAcc && !AllAx::anyPid && AllAx::sameLimits, "");
+    CHECK(AllAx::limitCcw[3] == 1023);
+}
+
+TEST_CASE("Crc16")
+{
+    const uint8_t check[]{'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    CHECK(crc16(0, check, sizeof(check)) == 0xFEE8);
+    CHECK(crc16(crc16(0, check, 4), check + 4, 5) == 0xFEE8);
+    CHECK(crc16(0, check, 0) == 0);
+}
+
+TEST_CASE("Simulator")
+{
+    host::SimBus bus{2};
+    bus.begin(1000000);
+    auto& s1 = *bus.servo(1);
+
+    // 6 bytes each way and 500 us of the default return delay.
+    auto t = micros();
+    CHECK(bus.ping(1) == DYN_STATUS_OK);
+    CHECK(micros() - t == 620);
+
+    t = micros();
+    CHECK(bus.ping(3) == (DYN_STATUS_COM_ERROR | DYN_STATUS_TIMEOUT));
+    CHECK(micros() - t == 50060);
+
+    uint16_t model{};
+    CHECK(bus.read(1, 0x00, model) == DYN_STATUS_OK);
+    CHECK(model == 360);
+    uint8_t big[8]{};
+    CHECK(bus.read(1, 0x48, 8, big) == DYN_STATUS_RANGE_ERROR);
+
+    // Torque goes on with the goal, speed 100 is 6245 units/s.
+    const uint8_t ids[]{1, 2};
+    const uint8_t speed[]{100, 0, 100, 0};
+    CHECK(bus.syncWrite(2, ids, 0x20, 2, speed) == DYN_STATUS_OK);
+    CHECK(bus.write(1, 0x1E, uint16_t{3048}) == DYN_STATUS_OK);
+    CHECK(s1.reg(0x18) == 1);
+    host::Clock::advance(50000);
+    uint8_t present[11]{};
+    CHECK(bus.read(1, 0x24, 11, present) == DYN_STATUS_OK);
+    CHECK((present[0] | present[1] << 8) == Approx(2048 + 6245 * 0.05).epsilon(0.02));
+    CHECK((present[2] | present[3] << 8) == 100);
+    CHECK(present[10] == 1);
+
+    host::Clock::advance(1000000);
+    CHECK(bus.read(1, 0x24, 11, present) == DYN_STATUS_OK);
+    CHECK((present[0] | present[1] << 8) == 3048);
+    CHECK((present[2] | present[3] << 8) == 0);
+    CHECK(present[10] == 0);
+    CHECK(bus.servo(2)->reg16(0x24) == 2048);
+
+    // Joint mode limits refuse goals outside.
+    CHECK(bus.write(2, 0x06, uint32_t{1000 | 3000ul << 16}) == DYN_STATUS_OK);
+    CHECK(bus.write(2, 0x1E, uint16_t{3500}) == DYN_STATUS_ANGLE_LIMIT_ERROR);
+    CHECK(bus.servo(2)->reg16(0x1E) == 2048);
+
+    // Broadcast gets no reply, servo at other baud rate does not hear.
+    CHECK(bus.write(BROADCAST_ID, DYN_ADDRESS_RDT, uint8_t{0}) == DYN_STATUS_OK);
+    CHECK(bus.write(1, DYN_ADDRESS_BAUDRATE, uint8_t{207}) == DYN_STATUS_OK);
+    CHECK(bus.ping(1) == (DYN_STATUS_COM_ERROR | DYN_STATUS_TIMEOUT));
+    bus.begin(9600);
+    t = micros();
+    CHECK(bus.ping(1) == DYN_STATUS_OK);
+    CHECK(micros() - t == 12500);
+    CHECK(bus.ping(2) == (DYN_STATUS_COM_ERROR | DYN_STATUS_TIMEOUT));
+
+    uint8_t bad[]{0xFF, 0xFF, 1, 2, DYN_PING, 0};
+    uint8_t rx[6]{};
+    CHECK(bus.transfer(bad, sizeof(bad), rx, sizeof(rx)) == 6);
+    CHECK(rx[4] == DYN_STATUS_CHECKSUM_ERROR);
+}
+
+// Firmware of the sketch on a simulated bus of two servos, started from erased EEPROM.
+struct Rig {
+    Rig()
+    {
+        host::eraseEeprom();
+        bus.begin(1000000);
+        cb.begin();
+        out.drain();
+    }
+
+    // Main loop of the sketch, 1 ms per pass: at least 10 passes, then while a motion, a long
+    // output, a dwell or a program goes on, up to the given number. each() follows every pass.
+    template <typename F>
+    std::string run(const std::string& line, int passes, F each)
+    {
+        parser.parse(line.c_str(), static_cast<int>(line.length()));
+        for (int i = 0; i < passes && (i < 10 || cb.busy() || motors.isMoving() || !out.empty());
+             ++i) {
+            cb.loop();
+            out.drain();
+            each();
+            host::Clock::advance(1000);
+        }
+        return term.take();
+    }
+
+    std::string run(const std::string& line, int passes = 5000)
+    {
+        return run(line, passes, [] {});
+    }
+
+    host::SimBus bus{2};
+    host::Terminal term;
+    Motors<2> motors{&bus};
+    OutQueue out{&term};
+    CallbacksImpl<2> cb{&out, &motors};
+    Parser<2> parser{&cb};
+};
+
+TEST_CASE_METHOD(Rig, "Firmware")
+{
+    CHECK(term.take() == "ok\n");
+    CHECK(bus.servo(1)->reg(0x49) == 233);
+    CHECK(bus.servo(2)->reg(0x1C) == 13);
+
+    // Joint limits in the servo EEPROM are read back, only a servo which differs gets them.
+    CHECK(bus.servo(1)->reg16(0x06) == 0xFFF);
+    CHECK(bus.write(2, 0x06, uint16_t{0}) == DYN_STATUS_OK);
+    auto initPackets = bus.packets();
+    motors.init();
+    CHECK(bus.packets() - initPackets == 2 * 3 + 1);
+    CHECK(bus.servo(2)->reg16(0x06) == 0xFFF);
+    initPackets = bus.packets();
+    motors.init();
+    CHECK(bus.packets() - initPackets == 2 * 3);
+
+    const auto moved = run("g0 x10 y5 m2\n");
+    CHECK_THAT(moved, StartsWith("ok\n<Run|MPos:"));
+    CHECK_THAT(moved, Contains("[MSG:Pgm End]"));
+    CHECK(bus.servo(1)->reg16(0x24) == 114);
+    CHECK(bus.servo(2)->reg16(0x24) == 57);
+    CHECK_THAT(run("?\n"), StartsWith("<Idle|MPos:10.03,5.02,0.000|"));
+    CHECK(run("$120=1000\n") == "ok\n");
+    CHECK(bus.servo(1)->reg(0x49) == 117);
+    CHECK(bus.servo(2)->reg(0x49) == 233);
+    CHECK(run("$5=-1\n") == "setting value out of range; \n");
+    CHECK(run("$5=4\n") == "setting value out of range; \n");
+
+    CHECK(bus.timeouts() == 0);
+
+    const auto prof = run("%5\n");
+    CHECK_THAT(prof, StartsWith("[MSG:Prof parse n:0 min:0 mean:0 max:0]\n"));
+    CHECK_THAT(prof, Contains("[MSG:Prof bus n:"));
+    CHECK_THAT(prof, EndsWith("]\nok\n"));
+    CHECK(std::count(prof.begin(), prof.end(), '\n') == 9);
+    CHECK(run("%6\n") == "ok\n");
+    CHECK_THAT(run("%5\n"), Contains("[MSG:Prof bus n:2 "));
+
+    Scheduler<1> sched;
+    sched.add("control", [](void*) {}, nullptr, 1000, 0, 100);
+    cb.tasks(&sched);
+    CHECK(run("%7\n") == "[MSG:Task control runs:0 max:0 over:0 late:0 defer:0]\nok\n");
+    CHECK(run("%9\n") == "[MSG:Mem free:0 low:0]\nok\n");
+
+    // ? during a long output is answered at once, the acks of both lines follow the output.
+    parser.parse("$$\n", 3);
+    REQUIRE(cb.busy());
+    REQUIRE(cb.accepts('?'));
+    const auto dump = run("?\n");
+    CHECK_THAT(dump, StartsWith("<Idle|MPos:"));
+    CHECK_THAT(dump, Contains(">\n$3=0.00\n$5=0.00\n"));
+    CHECK_THAT(dump, EndsWith("\nok\nok\n"));
+    CHECK(std::count(dump.begin(), dump.end(), 'k') == 2);
+
+    // Acks of lines parsed during a long output are counted beyond 255, what the queue has no room
+    // for is dropped.
+    parser.parse("$$\n", 3);
+    std::string many;
+    for (int i = 0; i < 300; ++i) {
+        many += "$51=500\n";
+    }
+    const auto dropped = out.dropped();
+    const auto held = run(many);
+    const auto heldAcks = held.substr(held.find("$241=1.00\n") + 10);
+    CHECK_THAT(heldAcks, StartsWith("ok\nok\n"));
+    CHECK(heldAcks.size() + out.dropped() - dropped == 301 * 3);
+
+    // Ack of a line does not overtake the error reply of an earlier one, status reports do.
+    parser.parse("$999=1\n", 7);
+    CHECK(run("?\n") == "<Idle|MPos:10.03,5.02,0.000|FS:0,0|Pn:YZ|WCO:20.000,0.000,0.000>\n"
+                         "unknown setting; \nok\n");
+
+    // At rest the state is read every $51 ms and on the tick after a command, one read per servo.
+    CHECK(run("$51=100\n") == "ok\n");
+    const auto packets = bus.packets();
+    for (int i = 0; i < 1000; ++i) {
+        cb.loop();
+        host::Clock::advance(1000);
+    }
+    CHECK(bus.packets() - packets == 2 * 10);
+    CHECK(run("?\n") == "<Idle|MPos:10.03,5.02,0.000|FS:0,0|Pn:YZ|WCO:20.000,0.000,0.000>\nok\n");
+    CHECK(bus.packets() - packets == 2 * 11);
+
+    // At rest ? waits for the next state read, a servo pushed by hand shows where it is now.
+    CHECK(run("$250=0\n") == "ok\n");
+    bus.servo(1)->setPosition(228);
+    CHECK(run("?\n") == "<Idle|MPos:20.06,5.02,0.000|FS:0,0|Pn:YZ|WCO:20.000,0.000,0.000>\nok\n");
+    bus.servo(1)->setPosition(114);
+
+    // Dwell counts from the end of the motion and holds its ack and the next lines.
+    CHECK(run("$40=0\n") == "ok\n");
+    const std::string seq = "g0 x20\ng4 p300\n";
+    parser.parse(seq.c_str(), static_cast<int>(seq.size()));
+    unsigned long ended = 0;
+    std::string acks;
+    for (int i = 0; i < 3000 && acks != "ok\nok\n"; ++i) {
+        CHECK_FALSE(cb.accepts('g'));
+        cb.loop();
+        out.drain();
+        acks += term.take();
+        if (!ended && !motors.isMoving()) {
+            ended = millis();
+        }
+        host::Clock::advance(1000);
+    }
+    CHECK(acks == "ok\nok\n");
+    CHECK(millis() - ended == Approx(300).margin(2));
+    CHECK(cb.accepts('g'));
+
+    // Stop ends the wait for the motion, its ack follows the held one.
+    const std::string wait = "g0 x10\nm400\n";
+    parser.parse(wait.c_str(), static_cast<int>(wait.size()));
+    for (int i = 0; i < 20; ++i) {
+        cb.loop();
+        out.drain();
+        host::Clock::advance(1000);
+    }
+    CHECK(term.take() == "ok\n");
+    CHECK(motors.isMoving());
+    CHECK(run("!\n") == "ok\nok\n");
+    CHECK(run("$40=200\n") == "ok\n");
+
+    // Arrival within 5 deg at any speed ends the motion early, the servo goes on to the goal.
+    CHECK(run("$47=5\n$48=100000\n$49=1\n") == "ok\nok\nok\n");
+    CHECK_THAT(run("g0 x30 m2\n"), EndsWith("[MSG:Pgm End]<Idle|MPos:25.08,5.02,0.000|FS:0,0|Pn:YZ|"
+                                             "WCO:20.000,0.000,0.000>\n"));
+
+    // A servo which stops answering is not taken as arrived.
+    CHECK(bus.write(2, DYN_ADDRESS_BAUDRATE, uint8_t{207}) == DYN_STATUS_OK);
+    parser.parse("g0 x10\n", 7);
+    for (int i = 0; i < 3000; ++i) {
+        cb.loop();
+        out.drain();
+        host::Clock::advance(1000);
+    }
+    CHECK(bus.servo(1)->reg16(0x24) == bus.servo(1)->reg16(0x1E));
+    CHECK(motors.isMoving());
+}
+
+TEST_CASE_METHOD(Rig, "Tracking")
+{
+    // Ramp of 20 deg/s sampled every 25 ms, the sender clock is ahead by 100 s.
+    const auto target = [](unsigned long t) { return 10.f + 20.f * t / 1000.f; };
+    Tracker<2> tr;
+    for (unsigned long t = 0; t <= 1000; t += 25) {
+        // Trip takes from 5 to 15 ms.
+        const unsigned long now = t + 5 + t % 30 / 3;
+        CHECK(tr.add(t + 100000, {target(t), NAN}, now, 0.5f, 0.1f));
+    }
+    CHECK_FALSE(tr.add(100500, {0.f, 0.f}, 1020, 0.5f, 0.1f));
+    CHECK(tr.velocity()[0] == Approx(20.f).epsilon(0.01));
+    CHECK(tr.at(1105)[0] == Approx(target(1100)).epsilon(0.001));
+    CHECK(isnan(tr.at(1105)[1]));
+
+    // Sender clock 0.5% faster or slower than the device one, for ten minutes.
+    for (const float rate : {1.005f, 0.995f}) {
+        Tracker<1> drift;
+        unsigned long now = 0;
+        for (unsigned long t = 0; t <= 600000; t += 25) {
+            // Trip takes from 5 to 15 ms.
+            now = t + 5 + t % 30 / 3;
+            const auto ts = static_cast<unsigned long>(lroundf(t * rate)) + 100000;
+            drift.add(ts, FVec<1>{target(t)}, now, 0.5f, 0.1f);
+        }
+        CHECK(drift.at(now + 105)[0] == Approx(target(600100)).margin(0.3));
+    }
+
+    const std::string quiet = "$40=0\n";
+    parser.parse(quiet.c_str(), static_cast<int>(quiet.size()));
+    out.drain();
+    CHECK(term.take() == "ok\nok\n");
+
+    // Samples arrive 10 ms after they are taken, the loop runs every 10 ms.
+    const auto start = millis();
+    unsigned long t = 0;
+    for (; t <= 1500; t += 5) {
+        if (t % 25 == 10) {
+            const auto line = "@" + std::to_string(t - 10) + " x" + std::to_string(target(t - 10))
+                    + " y5\n";
+            REQUIRE(cb.accepts(line[0]));
+            parser.parse(line.c_str(), static_cast<int>(line.size()));
+        }
+        if (t % 10 == 0) {
+            cb.loop();
+            out.drain();
+        }
+        host::Clock::advance(start * 1000 + t * 1000 - micros());
+    }
+    CHECK(motors.isMoving());
+    CHECK_FALSE(cb.accepts('g'));
+    CHECK(bus.servo(1)->reg16(0x24) * 0.088f == Approx(target(t)).margin(0.5));
+    CHECK(bus.servo(2)->reg16(0x24) * 0.088f == Approx(5.f).margin(0.1));
+    std::string acks;
+    for (int i = 0; i < 60; ++i) {
+        acks += "ok\n";
+    }
+    CHECK(term.take() == acks);
+
+    // Target is lost when samples stop, the servo stays at the last goal.
+    for (int i = 0; i < 100; ++i) {
+        cb.loop();
+        out.drain();
+        host::Clock::advance(10000);
+    }
+    CHECK(term.take() == "[MSG:Track lost]\n");
+    CHECK_FALSE(motors.isMoving());
+    CHECK(cb.accepts('g'));
+}
+
+TEST_CASE_METHOD(Rig, "Programs")
+{
+    const auto text = [](const std::string& line, const float* values) {
+        uint8_t tokens[prog::lineMax];
+        int used{};
+        const int n = prog::tokenize(line.c_str(), static_cast<int>(line.size()), tokens,
+                                     prog::lineMax, used);
+        if (n < 0 || used != static_cast<int>(line.size())) {
+            return std::string{"bad"};
+        }
+        StrBuf<prog::textMax> out;
+        const int end = prog::detokenize([&](int i) { return tokens[i]; }, 0, n, values, out);
+        return end == n ? std::string{out.c_str()} : "short";
+    };
+    const float values[prog::params]{1.f, 2.5f, -3.f, 0.f};
+    CHECK(text("G1 X10.5 y-3 F1200\n", nullptr) == "g1x10.500y-3f1200\n");
+    CHECK(text("$47=.05\r\n", nullptr) == "$47=0.050\n");
+    CHECK(text("%0 1 63 64\n", nullptr) == "%0 1 63 64\n");
+    CHECK(text("scan  x40 y10 p1\n", nullptr) == "scan x40y10p1\n");
+    CHECK(text("x-0.0004 y-40000\n", nullptr) == "x0.000y-40000.000\n");
+    CHECK(text("x#1 y#2 f#3\n", nullptr) == "x#1y#2f#3\n");
+    CHECK(text("x#1 y#2 f#3\n", values) == "x1y2.500f-3\n");
+    CHECK(text("%0 #1 #2\n", values) == "%0 1 2.500\n");
+    CHECK(text("x#0\n", nullptr) == "bad");
+    CHECK(text("x3000000\n", nullptr) == "bad");
+    CHECK(text(std::string(prog::lineMax, 'x') + "\n", nullptr) == "bad");
+
+    CHECK(term.take() == "ok\n");
+
+    // Passes where the x servo goes over 20 deg are counted.
+    int peaks = 0;
+    bool high = false;
+    const auto count = [&] {
+        const bool h = bus.servo(1)->reg16(0x24) * 0.088f > 19.f;
+        peaks += h && !high;
+        high = h;
+    };
+
+    CHECK(run("$40=0\no1 sub\ng1 x#1 f#2\ng4 p50\n\nx0\no1 endsub\n")
+          == "ok\nok\nok\nok\nok\nok\nok\n");
+    CHECK(run("o1 list\n") == "g1x#1f#2\ng4p50\nx0\nok\n");
+
+    // Program lines are quiet, the ack of the call comes at the end.
+    CHECK(run("x0\n") == "ok\n");
+    peaks = 0;
+    CHECK(run("o1 call [20] [6000] l3\n", 20000, count) == "ok\n");
+    CHECK(peaks == 3);
+    CHECK(bus.servo(1)->reg16(0x24) == 0);
+    CHECK(cb.accepts('g'));
+
+    // Error ends the program and replies to the call.
+    CHECK(run("o2 sub\nx5\n$999=1\nx10\no2 endsub\n") == "ok\nok\nok\nok\nok\n");
+    CHECK(run("o2 call\n") == "unknown setting; program 2 line 2\n");
+    CHECK(bus.servo(1)->reg16(0x24) * 0.088f == Approx(5.f).margin(0.15));
+    CHECK(run("o3 call\n") == "unknown program; \n");
+    CHECK(run("o9 sub\n") == "unknown program; \n");
+
+    // Stop ends the program, its ack follows the one of the call.
+    parser.parse("o1 call [20] [600]\n", 19);
+    for (int i = 0; i < 100; ++i) {
+        cb.loop();
+        out.drain();
+        host::Clock::advance(1000);
+    }
+    CHECK(term.take().empty());
+    CHECK(motors.isMoving());
+    CHECK(run("!\n") == "ok\nok\n");
+
+    // Program too long is not kept, nor is one whose end never came.
+    std::string lines = "o3 sub\n";
+    for (int i = 0; i < ProgramStore<2>::capacity / 8; ++i) {
+        lines += "g1x1.5y-2.5\n";
+    }
+    CHECK_THAT(run(lines + "o3 endsub\n"), Contains("program too long; \n"));
+    CHECK(run("o3 list\n") == "unknown program; \n");
+    CHECK(ProgramStore<2>::length(1) == 15);
+
+    // A stored scan keeps its word apart from the span.
+    CHECK(run("o0 sub\nscan x40 y0\no0 endsub\n") == "ok\nok\nok\n");
+    CHECK(run("o0 list\n") == "scan x40y0\nok\n");
+    CHECK(run("o0 call\n") == "[MSG:Scan 1/2]\n[MSG:Scan 2/2]\nok\n");
+}
+
+// Saves the settings, every profile and every full program, then reads all of them back.
+template <int N>
+void fillEeprom()
+{
+    host::eraseEeprom();
+    auto set = baseSettings<N>();
+    set.homingPullOff_ = 12.f;
+    SetStore<N>::save(set);
+    for (int k = 0; k < ProfileStore<N>::count; ++k) {
+        set.torque_[0] = 0.1f * k;
+        ProfileStore<N>::save(k, set);
+    }
+    for (int k = 0; k < ProgramStore<N>::count; ++k) {
+        ProgramStore<N>::begin(k);
+        for (int i = 0; i < ProgramStore<N>::capacity; ++i) {
+            ProgramStore<N>::write(k, i, static_cast<uint8_t>(k + i));
+        }
+        ProgramStore<N>::end(k, ProgramStore<N>::capacity);
+    }
+    Set<N> loaded{};
+    CHECK(SetStore<N>::load(loaded) == SetStore<N>::Res::Ok);
+    CHECK(loaded.homingPullOff_ == 12.f);
+    for (int k = 0; k < ProfileStore<N>::count; ++k) {
+        CHECK(ProfileStore<N>::load(k, loaded));
+        CHECK(loaded.torque_[0] == Approx(0.1f * k));
+    }
+    for (int k = 0; k < ProgramStore<N>::count; ++k) {
+        REQUIRE(ProgramStore<N>::length(k) == ProgramStore<N>::capacity);
+        for (int i = 0; i < ProgramStore<N>::capacity; i += 7) {
+            CHECK(ProgramStore<N>::byte(k, i) == static_cast<uint8_t>(k + i));
+        }
+    }
+}
+
+TEST_CASE("Eeprom")
+{
+    REQUIRE(EEPROM.length() == 1024);
+    fillEeprom<2>();
+    CHECK(ProfileStore<2>::count == GSERVO_PROFILES);
+    CHECK(ProgramStore<2>::count == GSERVO_PROGRAMS);
+
+    // Six axes on a Nano: every profile fits, no program slot is left.
+    fillEeprom<6>();
+    CHECK(ProfileStore<6>::count == GSERVO_PROFILES);
+    CHECK(ProgramStore<6>::count == 0);
+}
+
+TEST_CASE_METHOD(Rig, "Scan")
+{
+    using V = FVec<2>;
+    const auto tiles = [](Scan<2>& scan) {
+        std::vector<V> all;
+        for (V p; scan.next(p);) {
+            all.push_back(p);
+        }
+        return all;
+    };
+    Scan<2> scan;
+    // 30 deg pictures overlapping by 0.3 step 21 deg at most, spread evenly over the span.
+    REQUIRE(scan.start({10.f, 0.f}, {80.f, 40.f}, V::ofConst(30.f), 0.3f, Scan<2>::Pattern::Rows));
+    CHECK(scan.total() == 8);
+    auto all = tiles(scan);
+    REQUIRE(all.size() == 8);
+    const float xs[]{-15.f, 10.f - 25.f / 3.f, 10.f + 25.f / 3.f, 35.f};
+    for (int i = 0; i < 8; ++i) {
+        CHECK(all[i][0] == Approx(xs[i < 4 ? i : 7 - i]));
+        CHECK(all[i][1] == Approx(i < 4 ? -5.f : 5.f));
+    }
+    CHECK(scan.done() == 8);
+
+    REQUIRE(scan.start({0.f, 0.f}, {72.f, 72.f}, V::ofConst(30.f), 0.3f,
+                       Scan<2>::Pattern::Spiral));
+    all = tiles(scan);
+    const int spiral[][2]{{0, 0}, {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1},
+                          {1, -1}};
+    REQUIRE(all.size() == 9);
+    for (int i = 0; i < 9; ++i) {
+        CHECK(all[i][0] == Approx(21.f * spiral[i][0]));
+        CHECK(all[i][1] == Approx(21.f * spiral[i][1]));
+    }
+
+    // Spiral in a single row goes out from the middle, the axis without span stays.
+    REQUIRE(scan.start({0.f, 5.f}, {93.f, NAN}, V::ofConst(30.f), 0.3f, Scan<2>::Pattern::Spiral));
+    all = tiles(scan);
+    REQUIRE(all.size() == 4);
+    const float row[]{-10.5f, 10.5f, -31.5f, 31.5f};
+    for (int i = 0; i < 4; ++i) {
+        CHECK(all[i][0] == Approx(row[i]));
+        CHECK(isnan(all[i][1]));
+    }
+
+    CHECK(scan.start({0.f, 0.f}, {20.f, 20.f}, V::ofConst(30.f), 0.3f, Scan<2>::Pattern::Rows));
+    CHECK(scan.total() == 1);
+    CHECK_FALSE(scan.start({0.f, 0.f}, {20.f, 20.f}, {30.f, 0.f}, 0.3f, Scan<2>::Pattern::Rows));
+    CHECK_FALSE(scan.start({0.f, 0.f}, {3000.f, 90.f}, V::ofConst(30.f), 0.3f,
+                           Scan<2>::Pattern::Rows));
+
+    host::Pins::reset();
+    CHECK(term.take() == "ok\n");
+
+    // The shutter should only open once the servos have stopped at the picture and $53 is over.
+    std::vector<V> shots;
+    unsigned long ended = 0;
+    bool level = false;
+    const auto shoot = [&] {
+        if (motors.isMoving()) {
+            ended = 0;
+        }
+        else if (!ended) {
+            ended = millis();
+        }
+        if (host::Pins::level(7) && !level) {
+            CHECK_FALSE(motors.isMoving());
+            CHECK(millis() - ended == Approx(200).margin(5));
+            V p;
+            for (int a = 0; a < 2; ++a) {
+                p[a] = bus.servo(a + 1)->reg16(0x24) * 0.088f;
+            }
+            shots.push_back(p);
+        }
+        level = host::Pins::level(7);
+    };
+
+    // The shutter pin is an output at low level once set, pins of Serial and the bus are refused.
+    CHECK(run("$56=2\n", 100, shoot) == "pin is in use; \n");
+    CHECK_FALSE(host::Pins::output(2));
+    CHECK(run("$40=0\n$56=7\ng0 x40 y20\n", 5000, shoot) == "ok\nok\nok\n");
+    CHECK(host::Pins::output(7));
+    CHECK(host::Pins::rises(7) == 0);
+    CHECK(run("scan x80 y40\n", 20000, shoot)
+          == "[MSG:Scan 1/8]\n[MSG:Scan 2/8]\n[MSG:Scan 3/8]\n[MSG:Scan 4/8]\n[MSG:Scan 5/8]\n"
+             "[MSG:Scan 6/8]\n[MSG:Scan 7/8]\n[MSG:Scan 8/8]\nok\n");
+    CHECK(host::Pins::rises(7) == 8);
+    CHECK_FALSE(host::Pins::level(7));
+    REQUIRE(shots.size() == 8);
+    for (int i = 0; i < 8; ++i) {
+        CHECK(shots[i][0] == Approx(xs[i < 4 ? i : 7 - i] + 30.f).margin(0.2));
+        CHECK(shots[i][1] == Approx(i < 4 ? 15.f : 25.f).margin(0.2));
+    }
+    CHECK(cb.accepts('g'));
+
+    // Stop ends the scan with the shutter closed, its ack follows the one of the scan.
+    CHECK(run("scan x80 y40 p1\n", 1200, shoot) == "[MSG:Scan 1/8]\n");
+    CHECK_FALSE(cb.accepts('g'));
+    CHECK(run("!\n", 100, shoot) == "ok\nok\n");
+    CHECK_FALSE(host::Pins::level(7));
+    CHECK(cb.accepts('g'));
+    CHECK(run("$160=0\nscan x80\n", 100, shoot) == "ok\nscan out of range; \n");
+    CHECK(run("scan x80 p2\n", 100, shoot) == "unknown scan pattern; \n");
+
+    // A stored pin is set up at boot.
+    host::Pins::reset();
+    CallbacksImpl<2> booted{&out, &motors};
+    booted.begin();
+    CHECK(host::Pins::output(7));
+}
+
+namespace {
+// Task which takes its context in microseconds of simulated time.
+void work(void* us)
+{
+    host::Clock::advance(*static_cast<unsigned long*>(us));
+}
+} // namespace
+
+TEST_CASE("Scheduler")
+{
+    unsigned long control = 2000;
+    unsigned long rx = 500;
+    unsigned long bulk = 3000;
+    Scheduler<3> s;
+    CHECK(s.add("control", work, &control, 10000, 0, 2500) == 0);
+    CHECK(s.add("rx", work, &rx, 0, 1, 1000) == 1);
+    CHECK(s.add("bulk", work, &bulk, 0, 2, 3000) == 2);
+    CHECK(s.add("more", work, &bulk, 0, 2, 3000) == -1);
+
+    // Control keeps 100 Hz while the others fill the rest, a second of loop passes.
+    const auto start = micros();
+    while (micros() - start < 1000000) {
+        if (!s.run()) {
+            host::Clock::advance(10);
+        }
+    }
+    CHECK(s.task(0).runs == 100);
+    CHECK(s.task(0).late == 0);
+    CHECK(s.task(0).overruns == 0);
+    CHECK(s.task(1).runs > 100);
+    CHECK(s.task(2).runs > 100);
+    CHECK(s.task(2).deferred > 0);
+    // A wait is counted once however many loop passes it spans.
+    CHECK(s.task(2).deferred <= s.task(2).runs);
+    CHECK(s.task(2).maxUs == 3000);
+
+    // Over budget and missed periods are counted.
+    control = 25000;
+    s.reset();
+    CHECK(s.task(0).runs == 0);
+    const auto again = micros();
+    while (micros() - again < 100000) {
+        if (!s.run()) {
+            host::Clock::advance(10);
+        }
+    }
+    CHECK(s.task(0).overruns == s.task(0).runs);
+    CHECK(s.task(0).late > 0);
+
+    host::Terminal term;
+    CHECK(s.print(term, 0, 100) == 1);
+    CHECK_THAT(term.take(), StartsWith("[MSG:Task control runs:"));
+}
+
+TEST_CASE("Profiler")
+{
+    CHECK(Profiler::bucket(0) == 0);
+    CHECK(Profiler::bucket(31) == 0);
+    CHECK(Profiler::bucket(32) == 1);
+    CHECK(Profiler::bucket(100) == 2);
+    CHECK(Profiler::bucket(1000000) == 13);
+
+    Profiler p;
+    p.add(Profiler::Bus, 300);
+    p.add(Profiler::Bus, 100);
+    const auto& st = p.stats(Profiler::Bus);
+    CHECK(st.n == 2);
+    CHECK(st.min == 100);
+    CHECK(st.max == 300);
+    CHECK(st.hist[2] == 1);
+    CHECK(st.hist[4] == 1);
+
+    host::Terminal term;
+    CHECK(p.print(term, 2, 210) == 4);
+    CHECK(term.take() == "[MSG:Prof bus n:2 min:100 mean:200 max:300]\n"
+                         "[MSG:Prof bus log2:0,0,1,0,1,0,0,0,0,0,0,0,0,0]\n");
+    CHECK(p.print(term, 4, 1000) == -1);
+    term.take();
+
+    // Hours of bus time do not wrap the mean.
+    for (int i = 0; i < 3; ++i) {
+        p.add(Profiler::Bus, 2000000000ul);
+    }
+    CHECK(p.print(term, 2, 105) == 3);
+    CHECK(term.take() == "[MSG:Prof bus n:5 min:100 mean:1200000080 max:2000000000]\n");
+    p.reset();
+    CHECK(p.stats(Profiler::Bus).n == 0);
+}
+TEST_CASE("Tty bus")
+{
+    host::Clock::realTime(true);
+    const int master = posix_openpt(O_RDWR | O_NOCTTY);
+    REQUIRE(master >= 0);
+    REQUIRE(grantpt(master) == 0);
+    REQUIRE(unlockpt(master) == 0);
+    gservod::TtyBus bus;
+    REQUIRE(bus.open(ptsname(master)));
+    bus.begin(1000000, 100);
+
+    // Simulated servos at the far end of the pty, whole instruction packets go to them. A missing
+    // servo does not answer, without the simulated wait for it.
+    host::SimBus sim{2};
+    sim.begin(1000000, 0);
+    std::atomic<bool> stop{false};
+    std::thread far{[&] {
+        std::vector<uint8_t> in;
+        while (!stop) {
+            pollfd p{master, POLLIN, 0};
+            uint8_t buf[64];
+            if (poll(&p, 1, 10) <= 0) {
+                continue;
+            }
+            const auto n = read(master, buf, sizeof(buf));
+            in.insert(in.end(), buf, buf + max(n, ssize_t{0}));
+            while (in.size() >= 4 && in.size() >= in[3] + 4u) {
+                const size_t len = in[3] + 4u;
+                const bool reply = in[2] != BROADCAST_ID || in[4] == DYN_BULK_READ;
+                uint8_t rx[dyn::packetMax];
+                const auto got = sim.transfer(in.data(), len, rx, reply ? sizeof(rx) : 0);
+                gservod::writeAll(master, rx, got);
+                in.erase(in.begin(), in.begin() + static_cast<long>(len));
+            }
+        }
+    }};
+
+    CHECK(bus.ping(1) == DYN_STATUS_OK);
+    CHECK(bus.ping(3) == (DYN_STATUS_COM_ERROR | DYN_STATUS_TIMEOUT));
+    uint16_t model{};
+    CHECK(bus.read(2, 0x00, model) == DYN_STATUS_OK);
+    CHECK(model == 360);
+    Motors<2> motors{&bus};
+    motors.init();
+    CHECK(motors.status() == nullptr);
+    CHECK(sim.servo(2)->reg16(DYN_ADDRESS_CCW_LIMIT) == 0xFFF);
+
+    stop = true;
+    far.join();
+    close(master);
+    host::Clock::realTime(false);
+}
+
+TEST_CASE("FdStream")
+{
+    int fds[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    gservod::FdStream link{fds[0], 8};
+    CHECK(write(fds[1], "?\ng0 x1", 7) == 7);
+    CHECK(link.receive());
+    CHECK(link.peek() == '?');
+    CHECK(link.line() == "?\n");
+    CHECK(link.line().empty());
+    CHECK(link.available() == 5);
+
+    CHECK(link.print("0123456789") == 8);
+    CHECK(link.availableForWrite() == 0);
+    CHECK(link.send());
+    CHECK(!link.pending());
+    char buf[16]{};
+    CHECK(read(fds[1], buf, sizeof(buf)) == 8);
+    CHECK(std::string(buf) == "01234567");
+
+    close(fds[1]);
+    CHECK(!link.receive());
+    close(fds[0]);
+
+    // Input stops at its cap and the rest waits in the socket, a line too long is cut.
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    gservod::FdStream capped{fds[0], 8, 2 * gservod::FdStream::lineMax};
+    const std::string lines(300, '\n');
+    CHECK(write(fds[1], lines.data(), lines.size()) == 300);
+    CHECK(capped.receive());
+    CHECK(capped.full());
+    CHECK(capped.available() == 256);
+    while (!capped.line().empty()) {
+    }
+    CHECK(!capped.full());
+    CHECK(capped.receive());
+    CHECK(capped.available() == 44);
+    while (!capped.line().empty()) {
+    }
+    const std::string longLine = std::string(200, 'x') + "\n?\n";
+    CHECK(write(fds[1], longLine.data(), longLine.size()) == 203);
+    CHECK(capped.receive());
+    CHECK(capped.line() == std::string(127, 'x') + "\n");
+    CHECK(capped.line() == "?\n");
+    close(fds[1]);
+    close(fds[0]);
+}
+
+TEST_CASE("Server")
+{
+    host::eraseEeprom();
+    host::SimBus bus{2};
+    bus.begin(1000000);
+    gservod::Server<2> server{&bus};
+    int a[2];
+    int b[2];
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, a) == 0);
+    REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, b) == 0);
+    REQUIRE(server.add(a[0]));
+    REQUIRE(server.add(b[0]));
+    server.begin();
+
+    // Daemon loop with a control tick every 10 ms, what each client got.
+    const auto take = [](int fd) {
+        std::string s;
+        char buf[256];
+        for (ssize_t n; (n = read(fd, buf, sizeof(buf))) > 0;) {
+            s.append(buf, static_cast<size_t>(n));
+        }
+        return s;
+    };
+    std::string gotA;
+    std::string gotB;
+    const auto run = [&](int ms) {
+        for (int i = 0; i < ms; ++i) {
+            if (i % 10 == 0) {
+                server.control();
+            }
+            server.receive(a[0]);
+            server.receive(b[0]);
+            server.serve();
+            server.send(a[0]);
+            server.send(b[0]);
+            host::Clock::advance(1000);
+        }
+        gotA = take(a[1]);
+        gotB = take(b[1]);
+    };
+    run(1);
+    CHECK(gotA == "ok\n");
+    CHECK(gotB.empty());
+
+    // Both get the pushes of one state read while a moves, b may not move meanwhile.
+    CHECK(write(a[1], "g0 x10\n", 7) == 7);
+    run(50);
+    CHECK_THAT(gotA, StartsWith("ok\n<Run|MPos:"));
+    CHECK_THAT(gotB, StartsWith("<Run|MPos:"));
+    const auto packets = bus.packets();
+    run(10);
+    CHECK(bus.packets() - packets == 2);
+    CHECK(write(b[1], "?\n", 2) == 2);
+    run(2000);
+    CHECK_THAT(gotB, StartsWith("<Run|MPos:"));
+    const std::string tail = ",180.22,0.000|FS:0,0|Pn:YZ|WCO:20.000,0.000,0.000>\n";
+    CHECK_THAT(gotB, EndsWith("<Idle|MPos:10.03" + tail));
+    CHECK_THAT(gotA, !Contains("ok"));
+    CHECK(write(b[1], "g0 x20\n$110=100\n!\n", 18) == 18);
+    run(10);
+    // Stop is for everyone, its ack follows the errors of the lines before it.
+    CHECK(gotB == "motion is locked by another client; \n"
+                  "motion is locked by another client; \nok\n");
+    CHECK(bus.servo(1)->reg16(DYN_ADDRESS_GOAL_POSITION) == 114);
+
+    // Stop goes through the dwell and the scan of another client at once, the held acks go to
+    // the client whose lines they are. So does ? with the cached state.
+    CHECK(write(a[1], "g4 p60000\n", 10) == 10);
+    run(10);
+    CHECK(gotA.empty());
+    CHECK(write(b[1], "?\n!\n", 4) == 4);
+    run(10);
+    CHECK(gotB == "<Idle|MPos:10.03" + tail + "ok\nok\n");
+    CHECK(gotA == "ok\n");
+    CHECK(write(a[1], "scan x40 y10\n", 13) == 13);
+    run(100);
+    CHECK_THAT(gotA, !Contains("ok"));
+    CHECK(server.motors().isMoving());
+    CHECK(write(b[1], "!\n", 2) == 2);
+    run(10);
+    CHECK_THAT(gotB, EndsWith("ok\n"));
+    CHECK_THAT(gotA, EndsWith("ok\n"));
+    run(3000);
+    CHECK_THAT(gotA, !Contains("[MSG:Scan"));
+    CHECK_THAT(gotB, !Contains("[MSG:Scan"));
+
+    // The lock goes with %11 or when its holder leaves. b drops the pushes and takes the lock.
+    CHECK(write(a[1], "%11\n", 4) == 4);
+    CHECK(write(b[1], "%12 0\ng0 x20\n", 13) == 13);
+    run(10);
+    CHECK(gotA == "ok\n");
+    CHECK(gotB == "ok\nok\n");
+    run(2000);
+    CHECK_THAT(gotA, EndsWith("<Idle|MPos:19.98" + tail));
+    CHECK(gotB.empty());
+    CHECK(write(a[1], "g0 x30\n", 7) == 7);
+    server.remove(b[0]);
+    run(2000);
+    CHECK_THAT(gotA, StartsWith("ok\n<Run|MPos:"));
+    CHECK_THAT(gotA, EndsWith("<Idle|MPos:30.01" + tail));
+    for (int fd : {a[0], a[1], b[0], b[1]}) {
+        close(fd);
+    }
+}
+
 } // namespace tests
 } // namespace gservo
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "parser.h"
+
+namespace gservo {
+
+// Target of the tracking mode, from samples stamped by the sender's clock. An alpha-beta filter
+// per axis runs on the sender's time, so link jitter does not disturb the velocity estimate, and
+// the target is extrapolated to the moment a goal will take effect.
+template <int N>
+class Tracker {
+public:
+    // Sample taken at sender time ts, ms, which arrived at device time now, ms. Axes the sample
+    // lacks keep their prediction. Returns false for a sample not newer than the last one.
+    bool add(unsigned long ts, const FVec<N>& pos, unsigned long now, float alpha, float beta)
+    {
+        if (!active_) {
+            x_ = pos;
+            v_ = FVec<N>::ofConst(0.f);
+            ts_ = ts;
+            offset_ = now - ts;
+            creep_ = 0;
+            last_ = now;
+            active_ = true;
+            return true;
+        }
+        const long dt = static_cast<long>(ts - ts_);
+        if (dt <= 0) {
+            return false;
+        }
+        // The sample with the shortest trip gives the best estimate of the clock offset. The offset
+        // creeps up by 1 ms per 128 ms of sender time and short trips pull it back, so it follows
+        // a sender clock up to 0.78% slower than the device one, not only faster ones.
+        creep_ += static_cast<unsigned long>(dt);
+        offset_ += creep_ / creepMs;
+        creep_ %= creepMs;
+        if (static_cast<long>(now - ts - offset_) < 0) {
+            offset_ = now - ts;
+        }
+        const float dts = dt / 1000.f;
+        for (int i = 0; i < N; ++i) {
+            const float xp = x_[i] + v_[i] * dts;
+            if (isnan(pos[i])) {
+                x_[i] = xp;
+            }
+            else if (isnan(xp)) {
+                x_[i] = pos[i];
+            }
+            else {
+                const float r = pos[i] - xp;
+                x_[i] = xp + alpha * r;
+                v_[i] += beta * r / dts;
+            }
+        }
+        ts_ = ts;
+        last_ = now;
+        return true;
+    }
+
+    // Predicted position at device time t, ms, NaN for axes never given.
+    FVec<N> at(unsigned long t) const
+    {
+        const float dt = static_cast<long>(t - offset_ - ts_) / 1000.f;
+        FVec<N> p;
+        for (int i = 0; i < N; ++i) {
+            p[i] = x_[i] + v_[i] * dt;
+        }
+        return p;
+    }
+
+    // Estimated velocity, deg/s.
+    const FVec<N>& velocity() const { return v_; }
+
+    bool active() const { return active_; }
+
+    // Device time of the last sample, ms.
+    unsigned long lastMs() const { return last_; }
+
+    void stop() { active_ = false; }
+
+private:
+    static constexpr unsigned long creepMs = 128;
+
+    FVec<N> x_{};
+    FVec<N> v_{};
+    unsigned long ts_{};
+    unsigned long offset_{};
+    unsigned long creep_{};
+    unsigned long last_{};
+    bool active_{};
+};
+
+} // namespace gservo